@@ -2,6 +2,7 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <unordered_map>
 #include <cmath>
@@ -9,7 +10,21 @@
 #include <ctime>
 #include <filesystem>
 #include <functional>
+
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <glob.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+#endif
 
 namespace fs = std::filesystem;
 
@@ -23,46 +38,48 @@ void log_message(const std::string &msg) {
     logFile << "[" << std::time(0) << "] " << msg << std::endl;
 }
 
-// Improved tokenizer to handle quotes and escape sequences
-std::vector<std::string> tokenize(const std::string &input) {
-    std::vector<std::string> tokens;
-    std::string token;
-    bool in_quotes = false;
-    bool escaped = false;
-    
-    for (size_t i = 0; i < input.length(); i++) {
-        if (escaped) {
-            token += input[i];
-            escaped = false;
-            continue;
-        }
-        
-        if (input[i] == '\\') {
-            escaped = true;
-            token += input[i];
-            continue;
-        }
-        
-        if (input[i] == '"') {
-            in_quotes = !in_quotes;
+// Tokenizer that handles quotes and escape sequences. Tokens are views into
+// the input, or into `arena` for tokens that had quotes removed; backslashes
+// are kept for process_escape_sequences.
+using Tokens = std::vector<std::string_view>;
+
+void tokenize(std::string_view input, std::string &arena, Tokens &tokens) {
+    arena.clear();
+    arena.reserve(input.length()); // tokens never grow, so views stay valid
+    tokens.clear();
+
+    size_t i = 0;
+    while (i < input.length()) {
+        if (input[i] == ' ') {
+            i++;
             continue;
         }
-        
-        if (input[i] == ' ' && !in_quotes) {
-            if (!token.empty()) {
-                tokens.push_back(token);
-                token.clear();
+
+        size_t begin = i;
+        size_t arenaStart = arena.size();
+        bool copied = false;
+        bool in_quotes = false;
+        for (; i < input.length() && (in_quotes || input[i] != ' '); i++) {
+            if (input[i] == '\\' && i + 1 < input.length()) {
+                if (copied) arena.append(input.substr(i, 2));
+                i++;
+            } else if (input[i] == '"') {
+                if (!copied) {
+                    arena.append(input.substr(begin, i - begin));
+                    copied = true;
+                }
+                in_quotes = !in_quotes;
+            } else if (copied) {
+                arena += input[i];
             }
-        } else {
-            token += input[i];
+        }
+
+        if (!copied) {
+            tokens.push_back(input.substr(begin, i - begin));
+        } else if (arena.size() > arenaStart) {
+            tokens.emplace_back(arena.data() + arenaStart, arena.size() - arenaStart);
         }
     }
-    
-    if (!token.empty()) {
-        tokens.push_back(token);
-    }
-    
-    return tokens;
 }
 
 // Error Handling
@@ -71,6 +88,7 @@ void show_error(const std::string &msg) {
     log_message("ERROR: " + msg);
 }
 
+#ifdef _WIN32
 // Execute External Commands with proper output handling
 std::string execute_command(const std::string &cmd) {
     std::string result;
@@ -89,6 +107,278 @@ std::string execute_command(const std::string &cmd) {
     return result;
 }
 
+// Run an external command and print its output
+void run_external_command(const std::string &cmd) {
+    std::string output = execute_command(cmd);
+    std::cout << output;
+    if (!output.empty() && output[output.length()-1] != '\n') {
+        std::cout << std::endl;
+    }
+}
+#else
+// Process Engine
+// External commands are launched directly with posix_spawn instead of going
+// through /bin/sh, and `a | b | c` pipelines are wired with kernel pipes.
+// Lines using shell syntax the engine does not understand (redirection,
+// command lists, substitutions, ...) are still handed to /bin/sh -c.
+struct PipelineStage {
+    std::vector<std::string> argv;
+    std::string path; // resolved executable
+};
+
+bool is_glob_char(char c) {
+    return c == '*' || c == '?' || c == '[';
+}
+
+// Split a command line into pipeline stages. Returns false if the line needs
+// a real shell to be interpreted correctly.
+bool parse_pipeline(const std::string &cmd, std::vector<PipelineStage> &stages) {
+    stages.assign(1, PipelineStage{});
+    std::string word;
+    bool haveWord = false;   // "" is still a word
+    bool hasGlob = false;    // unquoted glob characters in the current word
+    bool quotedGlob = false; // quoted glob characters in the current word
+    char quote = 0;
+
+    auto finishWord = [&]() -> bool {
+        if (!haveWord) return true;
+        std::vector<std::string> &argv = stages.back().argv;
+        if (hasGlob) {
+            if (quotedGlob) return false; // glob() cannot tell them apart
+            glob_t matches;
+            if (glob(word.c_str(), GLOB_NOCHECK, nullptr, &matches) != 0) {
+                globfree(&matches);
+                return false;
+            }
+            for (size_t i = 0; i < matches.gl_pathc; i++) {
+                argv.emplace_back(matches.gl_pathv[i]);
+            }
+            globfree(&matches);
+        } else {
+            argv.push_back(word);
+        }
+        word.clear();
+        haveWord = hasGlob = quotedGlob = false;
+        return true;
+    };
+
+    for (size_t i = 0; i < cmd.length(); i++) {
+        char c = cmd[i];
+        if (quote == '\'') {
+            if (c == '\'') quote = 0;
+            else {
+                word += c;
+                quotedGlob |= is_glob_char(c);
+            }
+            continue;
+        }
+        if (quote == '"') {
+            if (c == '"') quote = 0;
+            else if (c == '$' || c == '`') return false;
+            else if (c == '\\' && i + 1 < cmd.length() && strchr("\"\\$`", cmd[i + 1])) word += cmd[++i];
+            else {
+                word += c;
+                quotedGlob |= is_glob_char(c);
+            }
+            continue;
+        }
+
+        switch (c) {
+            case '\'':
+            case '"':
+                quote = c;
+                haveWord = true;
+                break;
+            case '\\':
+                if (i + 1 < cmd.length()) {
+                    word += cmd[++i];
+                    quotedGlob |= is_glob_char(cmd[i]);
+                    haveWord = true;
+                }
+                break;
+            case ' ':
+            case '\t':
+                if (!finishWord()) return false;
+                break;
+            case '|':
+                if (!finishWord() || stages.back().argv.empty()) return false;
+                if (i + 1 < cmd.length() && cmd[i + 1] == '|') return false; // a || b
+                stages.emplace_back();
+                break;
+            case '*':
+            case '?':
+            case '[':
+                word += c;
+                haveWord = hasGlob = true;
+                break;
+            case '<': case '>': case '&': case ';': case '(': case ')':
+            case '`': case '$': case '{': case '}': case '~': case '#':
+            case '\n':
+                return false;
+            default:
+                word += c;
+                haveWord = true;
+                break;
+        }
+    }
+
+    if (quote != 0 || !finishWord()) return false;
+    return !stages.back().argv.empty();
+}
+
+// PATH lookup cache, cleared whenever PATH changes
+std::unordered_map<std::string, std::string> executable_cache;
+std::string executable_cache_path;
+
+// Find an executable the way execvp would. Returns "" if it is not on PATH.
+std::string resolve_executable(const std::string &name) {
+    if (name.find('/') != std::string::npos) {
+        return access(name.c_str(), X_OK) == 0 ? name : "";
+    }
+
+    auto pathVar = variables.find("PATH");
+    std::string path = pathVar != variables.end() ? pathVar->second : (getenv("PATH") ? getenv("PATH") : "");
+    if (path != executable_cache_path) {
+        executable_cache.clear();
+        executable_cache_path = path;
+    }
+
+    auto cached = executable_cache.find(name);
+    if (cached != executable_cache.end()) return cached->second;
+
+    size_t start = 0;
+    while (start <= path.length()) {
+        size_t end = path.find(':', start);
+        if (end == std::string::npos) end = path.length();
+        std::string dir = end > start ? path.substr(start, end - start) : ".";
+        std::string candidate = dir + "/" + name;
+
+        struct stat st;
+        if (stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(candidate.c_str(), X_OK) == 0) {
+            executable_cache[name] = candidate;
+            return candidate;
+        }
+        start = end + 1;
+    }
+    return "";
+}
+
+// Turn a command line into stages, falling back to /bin/sh -c when the engine
+// cannot run it natively (shell syntax, shell builtins, unknown commands).
+std::vector<PipelineStage> build_pipeline(const std::string &cmd) {
+    std::vector<PipelineStage> stages;
+    bool native = parse_pipeline(cmd, stages);
+    for (size_t i = 0; native && i < stages.size(); i++) {
+        PipelineStage &stage = stages[i];
+        if (stage.argv[0].find('=') != std::string::npos) {
+            native = false; // VAR=value prefix
+        } else {
+            stage.path = resolve_executable(stage.argv[0]);
+            native = !stage.path.empty();
+        }
+    }
+
+    if (!native) {
+        stages.assign(1, PipelineStage{{"/bin/sh", "-c", cmd}, "/bin/sh"});
+    }
+    return stages;
+}
+
+// Start every stage with its stdout wired to the next stage's stdin; the last
+// stage writes to outFd. Returns the pids of the processes that were started.
+std::vector<pid_t> spawn_pipeline(const std::vector<PipelineStage> &stages, int outFd) {
+    std::vector<pid_t> pids;
+    int inFd = -1;
+
+    for (size_t i = 0; i < stages.size(); i++) {
+        bool last = i + 1 == stages.size();
+        int pipeFds[2] = {-1, -1};
+        if (!last && pipe2(pipeFds, O_CLOEXEC) != 0) {
+            show_error("Failed to create pipe: " + std::string(strerror(errno)));
+            break;
+        }
+        int stageOut = last ? outFd : pipeFds[1];
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        if (inFd != -1) posix_spawn_file_actions_adddup2(&actions, inFd, STDIN_FILENO);
+        if (stageOut != STDOUT_FILENO) posix_spawn_file_actions_adddup2(&actions, stageOut, STDOUT_FILENO);
+
+        std::vector<char*> argv;
+        for (const std::string &arg : stages[i].argv) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+
+        pid_t pid;
+        int err = posix_spawn(&pid, stages[i].path.c_str(), &actions, nullptr, argv.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+
+        if (inFd != -1) close(inFd);
+        if (!last) close(pipeFds[1]);
+        inFd = pipeFds[0];
+
+        if (err != 0) {
+            show_error("Failed to start " + stages[i].argv[0] + ": " + strerror(err));
+            break;
+        }
+        pids.push_back(pid);
+    }
+
+    if (inFd != -1) close(inFd);
+    return pids;
+}
+
+// Wait for all processes of a pipeline. Returns the exit code of the last
+// stage, 128+signal if it was killed, or 127 if it never started.
+int wait_pipeline(const std::vector<pid_t> &pids, size_t stageCount) {
+    int status = 0;
+    for (pid_t pid : pids) {
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    }
+    if (pids.size() < stageCount) return 127;
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return status;
+}
+
+// Execute External Commands with proper output handling
+std::string execute_command(const std::string &cmd) {
+    std::string result;
+    int pipeFds[2];
+    if (pipe2(pipeFds, O_CLOEXEC) != 0) {
+        return "Error executing command.";
+    }
+
+    std::vector<PipelineStage> stages = build_pipeline(cmd);
+    std::vector<pid_t> pids = spawn_pipeline(stages, pipeFds[1]);
+    close(pipeFds[1]);
+
+    char buffer[65536];
+    ssize_t n;
+    while ((n = read(pipeFds[0], buffer, sizeof(buffer))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        result.append(buffer, n);
+    }
+    close(pipeFds[0]);
+
+    wait_pipeline(pids, stages.size());
+    return result;
+}
+
+// Run an external command with its output going straight to the terminal
+void run_external_command(const std::string &cmd) {
+    std::cout.flush();
+    fflush(stdout);
+
+    std::vector<PipelineStage> stages = build_pipeline(cmd);
+    wait_pipeline(spawn_pipeline(stages, STDOUT_FILENO), stages.size());
+}
+#endif
+
 // File Handling
 std::string read_file(const std::string &filename) {
     std::ifstream file(filename);
@@ -121,7 +411,7 @@ std::string process_escape_sequences(const std::string& input) {
     return output;
 }
 
-void write_file(const std::string &filename, const std::vector<std::string>& tokens) {
+void write_file(const std::string &filename, const Tokens& tokens) {
     std::ofstream file(filename);
     if (!file.is_open()) {
         show_error("Failed to open file for writing: " + filename);
@@ -155,7 +445,7 @@ void append_file(const std::string &filename, const std::string &content) {
 }
 
 // Directory Commands
-void change_directory(const std::vector<std::string>& tokens) {
+void change_directory(const Tokens& tokens) {
     if (tokens.size() < 2) {
         show_error("Usage: cd <directory>");
         return;
@@ -164,7 +454,7 @@ void change_directory(const std::vector<std::string>& tokens) {
         fs::current_path(tokens[1]);
         std::cout << "Changed directory to: " << fs::current_path() << std::endl;
     } catch (...) {
-        show_error("Directory not found: " + tokens[1]);
+        show_error("Directory not found: " + std::string(tokens[1]));
     }
 }
 
@@ -204,10 +494,12 @@ void remove_file(const std::string &filename) {
 
 // Execute Script
 void execute_script(const std::vector<std::string> &lines) {
+    std::string arena;
+    Tokens tokens;
     for (const std::string &line : lines) {
         if (line.empty() || line[0] == '#') continue; // Skip empty lines and comments
         
-        std::vector<std::string> tokens = tokenize(line);
+        tokenize(line, arena, tokens);
         if (tokens.empty()) continue;
 
         std::cout << "Executing: " << line << std::endl;
@@ -216,7 +508,7 @@ void execute_script(const std::vector<std::string> &lines) {
             std::string message;
             for (size_t i = 1; i < tokens.size(); i++) {
                 if (tokens[i][0] == '$') {
-                    std::string varName = tokens[i].substr(1);
+                    std::string varName(tokens[i].substr(1));
                     message += variables.count(varName) ? variables[varName] : "[Undefined: $" + varName + "]";
                 } else {
                     message += tokens[i];
@@ -227,7 +519,7 @@ void execute_script(const std::vector<std::string> &lines) {
         }
         else if (tokens[0] == "mkdir") {
             if (tokens.size() < 2) show_error("Usage: mkdir <directory>");
-            else create_directory(tokens[1]);
+            else create_directory(std::string(tokens[1]));
         }
         else if (tokens[0] == "cd") {
             if (tokens.size() < 2) show_error("Usage: cd <directory>");
@@ -235,22 +527,18 @@ void execute_script(const std::vector<std::string> &lines) {
         }
         else if (tokens[0] == "write") {
             if (tokens.size() < 3) show_error("Usage: write <file> <content>");
-            else write_file(tokens[1], tokens);
+            else write_file(std::string(tokens[1]), tokens);
         }
         else if (tokens[0] == "ls" || tokens[0] == "dir") {
             list_directory();
         }
         else if (tokens[0] == "rm" || tokens[0] == "del") {
             if (tokens.size() < 2) show_error("Usage: rm <filename>");
-            else remove_file(tokens[1]);
+            else remove_file(std::string(tokens[1]));
         }
         else {
-            // For external commands, execute and show output
-            std::string output = execute_command(line);
-            std::cout << output;
-            if (!output.empty() && output[output.length()-1] != '\n') {
-                std::cout << std::endl;
-            }
+            // For external commands, run them with output going to the console
+            run_external_command(line);
         }
     }
 }
@@ -283,12 +571,14 @@ void run_shell() {
         if (command == "exit") break;
         if (command.empty()) continue;
 
-        std::vector<std::string> tokens = tokenize(command);
+        std::string arena;
+        Tokens tokens;
+        tokenize(command, arena, tokens);
         if (tokens.empty()) continue;
 
         if (tokens[0] == "run") {
             if (tokens.size() < 2) show_error("Usage: run <script.mys>");
-            else run_script(tokens[1]);
+            else run_script(std::string(tokens[1]));
         } else {
             execute_script({command});
         }
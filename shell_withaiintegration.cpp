@@ -4,15 +4,57 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
+#include <cctype>
 #include <cmath>
 #include <cstdlib>
 #include <ctime>
 #include <filesystem>
 #include <functional>
+#include <memory>
+#include <deque>
+#include <string_view>
+#include <cstdint>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <future>
+#include <regex>
+#include <cstdio>
+#include <csignal>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
 
-
+#ifdef _WIN32
 #include <winsock2.h>
 #include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <climits>
+#include <dirent.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <spawn.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+extern char **environ;
+#endif
 
 #include <chrono>
 #include <iomanip>
@@ -23,16 +65,99 @@
 namespace fs = std::filesystem;
 using json = nlohmann::json;
 
+// File contents loaded by `read`. Large files stay memory-mapped and are
+// shared by every variable holding them; before the shell overwrites such a
+// file, detach() copies the contents out so the variables keep their value.
+class MappedFile {
+public:
+    MappedFile(const char* data, size_t size) : data_(data), size_(size) {}
+    ~MappedFile() { unmap(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    std::string_view view() const { return {data_, size_}; }
+
+    void detach() {
+        if (!copy_.empty() || size_ == 0) return;
+        copy_.assign(data_, size_);
+        unmap();
+        data_ = copy_.data();
+    }
+
+private:
+    void unmap() {
+#ifndef _WIN32
+        if (copy_.empty() && size_ > 0) munmap(const_cast<char*>(data_), size_);
+#endif
+    }
+
+    const char* data_;
+    size_t size_;
+    std::string copy_;
+};
+
+// A variable's value: owned text, or a shared view of a mapped file that is
+// replaced by owned text when the variable is assigned again
+class Value {
+public:
+    Value() = default;
+    Value(std::string text) : text_(std::move(text)) {}
+    Value(const char* text) : text_(text) {}
+    explicit Value(std::shared_ptr<MappedFile> mapped) : mapped_(std::move(mapped)) {}
+
+    std::string_view view() const { return mapped_ ? mapped_->view() : std::string_view(text_); }
+    std::string str() const { return std::string(view()); }
+    bool empty() const { return view().empty(); }
+
+private:
+    std::string text_;
+    std::shared_ptr<MappedFile> mapped_;
+};
+
+using Scope = std::unordered_map<std::string, Value>;
+
 // Global Storage
-std::unordered_map<std::string, std::string> variables;
+Scope variables;
 std::unordered_map<std::string, std::function<std::string(std::vector<std::string>)>> functions;
 std::string groq_api_key;
 
+// Nesting level of $(...) substitutions whose output is being captured
+int capture_depth = 0;
+
+// Function call frames for scripts; the innermost frame shadows `variables`
+std::vector<Scope> call_frames;
+
+const Value* find_variable(const std::string &name) {
+    if (!call_frames.empty()) {
+        auto local = call_frames.back().find(name);
+        if (local != call_frames.back().end()) return &local->second;
+    }
+    auto global = variables.find(name);
+    return global != variables.end() ? &global->second : nullptr;
+}
+
+// Assign to a local if one exists in the current frame, else to a global
+void assign_variable(const std::string &name, Value value) {
+    if (!call_frames.empty()) {
+        auto local = call_frames.back().find(name);
+        if (local != call_frames.back().end()) {
+            local->second = std::move(value);
+            return;
+        }
+    }
+    variables[name] = std::move(value);
+}
+
+std::string variable_or(const std::string &name, const std::string &fallback) {
+    auto it = variables.find(name);
+    return it != variables.end() ? it->second.str() : fallback;
+}
+
 // CURL callback for receiving data
-size_t WriteCallback(void* contents, size_t size, size_t nmemb, std::string* s) {
+size_t WriteCallback(char* contents, size_t size, size_t nmemb, void* s) {
     size_t newLength = size * nmemb;
     try {
-        s->append((char*)contents, newLength);
+        static_cast<std::string*>(s)->append(contents, newLength);
         return newLength;
     }
     catch(std::bad_alloc &e) {
@@ -40,38 +165,451 @@ size_t WriteCallback(void* contents, size_t size, size_t nmemb, std::string* s)
     }
 }
 
-// Logging System with timestamp formatting
-void log_message(const std::string &msg) {
-    auto now = std::chrono::system_clock::now();
-    auto time = std::chrono::system_clock::to_time_t(now);
+// Portable thread-safe localtime
+std::tm local_time(std::time_t time) {
     std::tm tm_buf;
+#ifdef _WIN32
     localtime_s(&tm_buf, &time);
-    
-    std::ofstream logFile("myshell.log", std::ios::app);
-    logFile << "[" << std::put_time(&tm_buf, "%Y-%m-%d %H:%M:%S") << "] " << msg << std::endl;
+#else
+    localtime_r(&time, &tm_buf);
+#endif
+    return tm_buf;
+}
+
+// Logging System
+// Records are pushed onto a lock-free ring buffer and written out by a
+// background thread that formats a whole batch and hands it to the OS in a
+// single write. The log file is rotated once it grows past a size limit.
+enum class LogLevel { Debug = 0, Info, Warning, Error };
+
+const char* log_level_name(LogLevel level) {
+    switch (level) {
+        case LogLevel::Debug: return "DEBUG";
+        case LogLevel::Info: return "INFO";
+        case LogLevel::Warning: return "WARNING";
+        case LogLevel::Error: return "ERROR";
+    }
+    return "INFO";
+}
+
+bool parse_log_level(std::string name, LogLevel &level) {
+    for (char &c : name) c = static_cast<char>(toupper(static_cast<unsigned char>(c)));
+    for (LogLevel candidate : {LogLevel::Debug, LogLevel::Info, LogLevel::Warning, LogLevel::Error}) {
+        if (name == log_level_name(candidate)) {
+            level = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+class Logger {
+public:
+    explicit Logger(const std::string &path) : path_(path) {
+        for (size_t i = 0; i < kCapacity; i++) {
+            slots_[i].seq.store(i, std::memory_order_relaxed);
+        }
+        writer_ = std::thread(&Logger::run, this);
+    }
+
+    ~Logger() {
+        stop_.store(true, std::memory_order_release);
+        wake_.notify_one();
+        if (writer_.joinable()) writer_.join();
+    }
+
+    void set_level(LogLevel level) { minLevel_.store(level, std::memory_order_relaxed); }
+    void set_max_size(std::uintmax_t bytes) { maxSize_.store(bytes, std::memory_order_relaxed); }
+
+    // Multi-producer enqueue; only spins when the ring is full
+    void log(LogLevel level, const std::string &msg) {
+        if (level < minLevel_.load(std::memory_order_relaxed)) return;
+
+        size_t pos = head_.load(std::memory_order_relaxed);
+        Slot *slot;
+        for (;;) {
+            slot = &slots_[pos & (kCapacity - 1)];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                // Ring is full, let the writer catch up
+                wake_.notify_one();
+                std::this_thread::yield();
+                pos = head_.load(std::memory_order_relaxed);
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+
+        slot->time = std::time(nullptr);
+        slot->level = level;
+        slot->text.assign(msg); // reuses the slot's capacity
+        slot->seq.store(pos + 1, std::memory_order_release);
+        wake_.notify_one();
+    }
+
+private:
+    static constexpr size_t kCapacity = 4096; // must be a power of two
+    static constexpr int kBackups = 3;
+
+    struct Slot {
+        std::atomic<size_t> seq;
+        std::time_t time;
+        LogLevel level;
+        std::string text;
+    };
+
+    void run() {
+        std::string batch;
+        for (;;) {
+            bool stopping = stop_.load(std::memory_order_acquire);
+            drain(batch);
+            if (!batch.empty()) {
+                write_batch(batch);
+                batch.clear();
+            } else if (stopping) {
+                break;
+            } else {
+                // Producers notify without holding the mutex, so bound the wait
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait_for(lock, std::chrono::milliseconds(100));
+            }
+        }
+        if (file_) fclose(file_);
+    }
+
+    void drain(std::string &batch) {
+        for (;;) {
+            Slot &slot = slots_[tail_ & (kCapacity - 1)];
+            if (slot.seq.load(std::memory_order_acquire) != tail_ + 1) break;
+
+            // Timestamps are only re-rendered when the second changes
+            if (slot.time != stampTime_) {
+                stampTime_ = slot.time;
+                std::tm tm_buf = local_time(slot.time);
+                char stamp[32];
+                strftime(stamp, sizeof(stamp), "[%Y-%m-%d %H:%M:%S] ", &tm_buf);
+                stamp_ = stamp;
+            }
+            batch += stamp_;
+            if (slot.level != LogLevel::Info) {
+                batch += log_level_name(slot.level);
+                batch += ": ";
+            }
+            batch += slot.text;
+            batch += '\n';
+
+            slot.seq.store(tail_ + kCapacity, std::memory_order_release);
+            tail_++;
+        }
+    }
+
+    void write_batch(const std::string &batch) {
+        std::uintmax_t maxSize = maxSize_.load(std::memory_order_relaxed);
+        if (file_ && maxSize > 0 && size_ > 0 && size_ + batch.size() > maxSize) {
+            rotate();
+        }
+        if (!file_ && !open()) return;
+
+        fwrite(batch.data(), 1, batch.size(), file_);
+        fflush(file_);
+        size_ += batch.size();
+    }
+
+    bool open() {
+        // Not inherited by the commands the shell starts
+#ifdef _WIN32
+        file_ = fopen(path_.c_str(), "abN");
+#else
+        file_ = fopen(path_.c_str(), "abe");
+#endif
+        if (!file_) return false;
+        fseek(file_, 0, SEEK_END);
+        long pos = ftell(file_);
+        size_ = pos > 0 ? static_cast<std::uintmax_t>(pos) : 0;
+        // The whole batch is written at once, so stdio buffering only adds a copy
+        setvbuf(file_, nullptr, _IONBF, 0);
+        return true;
+    }
+
+    // myshell.log -> myshell.log.1 -> ... -> myshell.log.<kBackups>
+    void rotate() {
+        fclose(file_);
+        file_ = nullptr;
+        for (int i = kBackups - 1; i >= 1; i--) {
+            std::string from = path_ + "." + std::to_string(i);
+            std::string to = path_ + "." + std::to_string(i + 1);
+            std::remove(to.c_str());
+            std::rename(from.c_str(), to.c_str());
+        }
+        std::string first = path_ + ".1";
+        std::remove(first.c_str());
+        std::rename(path_.c_str(), first.c_str());
+        open();
+    }
+
+    std::string path_;
+    Slot slots_[kCapacity];
+    std::atomic<size_t> head_{0};
+    size_t tail_ = 0; // writer thread only
+    std::atomic<LogLevel> minLevel_{LogLevel::Info};
+    std::atomic<std::uintmax_t> maxSize_{5 * 1024 * 1024};
+    std::atomic<bool> stop_{false};
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::thread writer_;
+
+    // Writer thread state
+    FILE* file_ = nullptr;
+    std::uintmax_t size_ = 0;
+    std::time_t stampTime_ = -1;
+    std::string stamp_;
+};
+
+Logger logger("myshell.log");
+
+void log_message(const std::string &msg, LogLevel level = LogLevel::Info) {
+    logger.log(level, msg);
+}
+
+// Worker Pool
+// A fixed set of threads, one per core, for builtins that fan work out.
+// Tasks must not touch shell state (variables, std::cout, last_status);
+// they hand their results back to the shell's thread instead.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads) {
+        for (size_t i = 0; i < threads; i++) {
+            workers_.emplace_back(&ThreadPool::run, this);
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        ready_.notify_all();
+        for (std::thread &worker : workers_) worker.join();
+    }
+
+    size_t size() const { return workers_.size(); }
+
+    std::future<void> submit(std::function<void()> task) {
+        std::packaged_task<void()> packaged(std::move(task));
+        std::future<void> done = packaged.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.push_back(std::move(packaged));
+        }
+        ready_.notify_one();
+        return done;
+    }
+
+private:
+    void run() {
+        for (;;) {
+            std::packaged_task<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                ready_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+                if (queue_.empty()) return;
+                task = std::move(queue_.front());
+                queue_.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::deque<std::packaged_task<void()>> queue_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    bool stopping_ = false;
+};
+
+// Started on first use, so scripts that never fan out pay nothing
+ThreadPool &worker_pool() {
+    static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+// Tokenizer
+// The lexer splits a line into words and operators without allocating per
+// token. Words are string_views into the line itself, or into the line's
+// arena when quotes or escapes had to be removed. Recognized operators:
+//   |  ||  &  &&  ;  >  >>  <  2>  2>>  2>&1
+// Outside quotes a backslash only escapes characters that are special to
+// the lexer, so Windows paths such as C:\Users keep their backslashes.
+enum class TokenKind {
+    Word, Pipe, Or, Background, And, Semicolon,
+    RedirectOut, RedirectAppend, RedirectIn, RedirectErrToOut,
+    RedirectErr, RedirectErrAppend
+};
+
+struct Token {
+    TokenKind kind;
+    std::string_view text; // word contents, or the operator itself
+    size_t begin, end;     // position in the source line
+};
+
+struct BuiltinCommand;
+
+// A command between `;`, `&&` and `||` separators
+struct CommandSegment {
+    size_t first, last;            // token range [first, last)
+    TokenKind separator;           // what follows it; Word at end of line
+    const BuiltinCommand* builtin; // resolved from the first word
+};
+
+struct LexedLine {
+    std::string arena;
+    std::vector<Token> tokens;
+    std::vector<CommandSegment> segments;
+};
+
+using Args = std::vector<std::string_view>;
+
+bool is_operator_char(char c) {
+    return c == '|' || c == '&' || c == ';' || c == '<' || c == '>';
+}
+
+bool is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+bool is_escapable(char c) {
+    return is_blank(c) || is_operator_char(c) || c == '"' || c == '\'' || c == '\\' || c == '$';
+}
+
+// When `operators` is false, operator characters are ordinary word
+// characters (used for conditions such as `$a <= 3`).
+void lex_line(std::string_view input, LexedLine &out, bool operators = true) {
+    out.arena.clear();
+    out.arena.reserve(input.length()); // words never grow, so views stay valid
+    out.tokens.clear();
+    out.segments.clear();
+
+    size_t i = 0;
+    const size_t len = input.length();
+    while (i < len) {
+        char c = input[i];
+        if (is_blank(c)) {
+            i++;
+            continue;
+        }
+
+        size_t begin = i;
+        if (operators && is_operator_char(c)) {
+            TokenKind kind;
+            size_t width = 1;
+            bool doubled = i + 1 < len && input[i + 1] == c;
+            switch (c) {
+                case '|': kind = doubled ? TokenKind::Or : TokenKind::Pipe; width = doubled ? 2 : 1; break;
+                case '&': kind = doubled ? TokenKind::And : TokenKind::Background; width = doubled ? 2 : 1; break;
+                case '>': kind = doubled ? TokenKind::RedirectAppend : TokenKind::RedirectOut; width = doubled ? 2 : 1; break;
+                case '<': kind = TokenKind::RedirectIn; break;
+                default: kind = TokenKind::Semicolon; break;
+            }
+            out.tokens.push_back({kind, input.substr(i, width), i, i + width});
+            i += width;
+            continue;
+        }
+        if (operators && input.compare(i, 4, "2>&1") == 0 && (i + 4 == len || is_blank(input[i + 4]) || is_operator_char(input[i + 4]))) {
+            out.tokens.push_back({TokenKind::RedirectErrToOut, input.substr(i, 4), i, i + 4});
+            i += 4;
+            continue;
+        }
+        if (operators && c == '2' && i + 1 < len && input[i + 1] == '>') {
+            bool doubled = i + 2 < len && input[i + 2] == '>';
+            size_t width = doubled ? 3 : 2;
+            out.tokens.push_back({doubled ? TokenKind::RedirectErrAppend : TokenKind::RedirectErr, input.substr(i, width), i, i + width});
+            i += width;
+            continue;
+        }
+
+        // Plain words are returned as views into the input; the first quote or
+        // escape switches to copying the word into the arena.
+        size_t arenaStart = out.arena.size();
+        bool copied = false;
+        auto startCopy = [&]() {
+            if (!copied) {
+                out.arena.append(input.substr(begin, i - begin));
+                copied = true;
+            }
+        };
+
+        while (i < len) {
+            c = input[i];
+            if (is_blank(c) || (operators && is_operator_char(c))) break;
+
+            if (c == '\\' && i + 1 < len && is_escapable(input[i + 1])) {
+                startCopy();
+                out.arena += input[i + 1];
+                i += 2;
+            } else if (c == '"') {
+                // Runs to the end of the line if unterminated
+                startCopy();
+                for (i++; i < len && input[i] != '"'; i++) {
+                    if (input[i] == '\\' && i + 1 < len && (input[i + 1] == '"' || input[i + 1] == '\\')) i++;
+                    out.arena += input[i];
+                }
+                i++;
+            } else if (c == '\'' && input.find('\'', i + 1) != std::string_view::npos) {
+                // An unmatched ' is an apostrophe, as in: ai what's new
+                startCopy();
+                size_t close = input.find('\'', i + 1);
+                out.arena.append(input.substr(i + 1, close - i - 1));
+                i = close + 1;
+            } else {
+                if (copied) out.arena += c;
+                i++;
+            }
+        }
+
+        std::string_view text = copied
+            ? std::string_view(out.arena.data() + arenaStart, out.arena.size() - arenaStart)
+            : input.substr(begin, i - begin);
+        out.tokens.push_back({TokenKind::Word, text, begin, std::min(i, len)});
+    }
 }
 
-// Improved Tokenizer that handles quoted strings
+// Word list for conditions, loop lists and headers, where operators are
+// literal text
 std::vector<std::string> tokenize(const std::string &input) {
-    std::vector<std::string> tokens;
-    std::istringstream stream(input);
-    std::string token;
-    bool inQuotes = false;
-    std::string quotedString;
-    
-    while (stream >> std::quoted(token)) {
-        tokens.push_back(token);
+    LexedLine lexed;
+    lex_line(input, lexed, false);
+    std::vector<std::string> words;
+    words.reserve(lexed.tokens.size());
+    for (const Token &token : lexed.tokens) {
+        words.emplace_back(token.text);
     }
-    
-    return tokens;
+    return words;
+}
+
+// Return the raw text of a command line after its first `words` words
+std::string rest_of_line(std::string_view line, size_t words) {
+    size_t pos = line.find_first_not_of(" \t");
+    for (size_t i = 0; i < words && pos != std::string_view::npos; i++) {
+        pos = line.find_first_of(" \t", pos);
+        if (pos != std::string_view::npos) pos = line.find_first_not_of(" \t", pos);
+    }
+    return pos == std::string_view::npos ? "" : std::string(line.substr(pos));
 }
 
+// Exit status of the last command; builtins fail by reporting an error
+int last_status = 0;
+
 // Error Handling
 void show_error(const std::string &msg) {
+    last_status = 1;
     std::cerr << "\033[1;31m[Error]\033[0m " << msg << std::endl;
-    log_message("ERROR: " + msg);
+    log_message(msg, LogLevel::Error);
 }
 
+#ifdef _WIN32
 // Execute External Commands with output capture
 std::string execute_command(const std::string &cmd) {
     std::string result;
@@ -101,663 +639,6345 @@ std::string execute_command(const std::string &cmd) {
     return result;
 }
 
-// File Handling with error checking
-std::string read_file(const std::string &filename) {
-    std::ifstream file(filename);
-    if (!file) {
-        show_error("File not found: " + filename);
-        return "";
+// Run an external command, forwarding its output to the console as it arrives
+int run_external_command(const std::string &cmd) {
+    if (capture_depth > 0) {
+        std::cout << execute_command(cmd);
+        return 0;
+    }
+    std::cout.flush();
+    FILE* pipe = _popen(cmd.c_str(), "r");
+    if (!pipe) {
+        show_error("Command failed to start: " + cmd);
+        return -1;
     }
-    std::stringstream buffer;
-    buffer << file.rdbuf();
-    return buffer.str();
-}
 
-void write_file(const std::string &filename, const std::string &content) {
-    std::ofstream file(filename);
-    if (!file) {
-        show_error("Cannot write to file: " + filename);
-        return;
+    static char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), pipe)) > 0) {
+        fwrite(buffer, 1, n, stdout);
+        fflush(stdout);
     }
-    file << content;
-    file.close();
-    std::cout << "Content written to " << filename << std::endl;
+
+    int status = _pclose(pipe);
+    if (status != 0) {
+        show_error("Command exited with status " + std::to_string(status) + ": " + cmd);
+    }
+    return status;
 }
+#else
+// Process Engine
+// External commands are launched directly with posix_spawn instead of going
+// through /bin/sh, and `a | b | c` pipelines are wired with kernel pipes.
+// Lines using shell syntax the engine does not understand (redirection,
+// command lists, substitutions, ...) are still handed to /bin/sh -c.
+struct PipelineStage {
+    std::vector<std::string> argv;
+    std::string path; // resolved executable
+};
 
-void append_file(const std::string &filename, const std::string &content) {
-    std::ofstream file(filename, std::ios::app);
-    if (!file) {
-        show_error("Cannot append to file: " + filename);
-        return;
+bool is_glob_char(char c) {
+    return c == '*' || c == '?' || c == '[';
+}
+
+// Split a command line into pipeline stages. Returns false if the line needs
+// a real shell to be interpreted correctly.
+bool parse_pipeline(const std::string &cmd, std::vector<PipelineStage> &stages) {
+    stages.assign(1, PipelineStage{});
+    std::string word;
+    bool haveWord = false;   // "" is still a word
+    bool hasGlob = false;    // unquoted glob characters in the current word
+    bool quotedGlob = false; // quoted glob characters in the current word
+    char quote = 0;
+
+    auto finishWord = [&]() -> bool {
+        if (!haveWord) return true;
+        std::vector<std::string> &argv = stages.back().argv;
+        if (hasGlob) {
+            if (quotedGlob) return false; // glob() cannot tell them apart
+            glob_t matches;
+            if (glob(word.c_str(), GLOB_NOCHECK, nullptr, &matches) != 0) {
+                globfree(&matches);
+                return false;
+            }
+            for (size_t i = 0; i < matches.gl_pathc; i++) {
+                argv.emplace_back(matches.gl_pathv[i]);
+            }
+            globfree(&matches);
+        } else {
+            argv.push_back(word);
+        }
+        word.clear();
+        haveWord = hasGlob = quotedGlob = false;
+        return true;
+    };
+
+    for (size_t i = 0; i < cmd.length(); i++) {
+        char c = cmd[i];
+        if (quote == '\'') {
+            if (c == '\'') quote = 0;
+            else {
+                word += c;
+                quotedGlob |= is_glob_char(c);
+            }
+            continue;
+        }
+        if (quote == '"') {
+            if (c == '"') quote = 0;
+            else if (c == '$' || c == '`') return false;
+            else if (c == '\\' && i + 1 < cmd.length() && strchr("\"\\$`", cmd[i + 1])) word += cmd[++i];
+            else {
+                word += c;
+                quotedGlob |= is_glob_char(c);
+            }
+            continue;
+        }
+
+        switch (c) {
+            case '\'':
+            case '"':
+                quote = c;
+                haveWord = true;
+                break;
+            case '\\':
+                if (i + 1 < cmd.length()) {
+                    word += cmd[++i];
+                    quotedGlob |= is_glob_char(cmd[i]);
+                    haveWord = true;
+                }
+                break;
+            case ' ':
+            case '\t':
+                if (!finishWord()) return false;
+                break;
+            case '|':
+                if (!finishWord() || stages.back().argv.empty()) return false;
+                if (i + 1 < cmd.length() && cmd[i + 1] == '|') return false; // a || b
+                stages.emplace_back();
+                break;
+            case '*':
+            case '?':
+            case '[':
+                word += c;
+                haveWord = hasGlob = true;
+                break;
+            case '<': case '>': case '&': case ';': case '(': case ')':
+            case '`': case '$': case '{': case '}': case '~': case '#':
+            case '\n':
+                return false;
+            default:
+                word += c;
+                haveWord = true;
+                break;
+        }
     }
-    file << content << "\n";
-    file.close();
-    std::cout << "Content appended to " << filename << std::endl;
+
+    if (quote != 0 || !finishWord()) return false;
+    return !stages.back().argv.empty();
 }
 
-// Directory Commands
-void change_directory(const std::vector<std::string>& tokens) {
-    if (tokens.size() < 2) {
-        show_error("Usage: cd <directory>");
-        return;
+// PATH lookup cache, cleared whenever PATH changes
+std::unordered_map<std::string, std::string> executable_cache;
+std::string executable_cache_path;
+
+// Find an executable the way execvp would. Returns "" if it is not on PATH.
+std::string resolve_executable(const std::string &name) {
+    if (name.find('/') != std::string::npos) {
+        return access(name.c_str(), X_OK) == 0 ? name : "";
     }
-    try {
-        fs::current_path(tokens[1]);
-        std::cout << "Changed directory to: " << fs::current_path().string() << std::endl;
-    } catch (const fs::filesystem_error& e) {
-        show_error("Directory error: " + std::string(e.what()));
-    } catch (...) {
-        show_error("Directory not found: " + tokens[1]);
+
+    auto pathVar = variables.find("PATH");
+    std::string path = pathVar != variables.end() ? pathVar->second.str() : (getenv("PATH") ? getenv("PATH") : "");
+    if (path != executable_cache_path) {
+        executable_cache.clear();
+        executable_cache_path = path;
     }
-}
 
-void list_directory(const std::string& path = ".") {
-    try {
-        std::string targetPath = path == "." ? fs::current_path().string() : path;
-        std::cout << "Contents of " << targetPath << ":\n";
-        
-        // Column formatting variables
-        int nameColWidth = 30;
-        int sizeColWidth = 10;
-        int typeColWidth = 10;
-        
-        // Print header
-        std::cout << std::left << std::setw(nameColWidth) << "Name" 
-                  << std::setw(sizeColWidth) << "Size" 
-                  << std::setw(typeColWidth) << "Type" << std::endl;
-        std::cout << std::string(nameColWidth + sizeColWidth + typeColWidth, '-') << std::endl;
-        
-        for (const auto &entry : fs::directory_iterator(targetPath)) {
-            std::string name = entry.path().filename().string();
-            std::string size = entry.is_directory() ? "-" : std::to_string(fs::file_size(entry.path())) + "B";
-            std::string type = entry.is_directory() ? "Dir" : "File";
-            
-            std::cout << std::left << std::setw(nameColWidth) << name 
-                      << std::setw(sizeColWidth) << size 
-                      << std::setw(typeColWidth) << type << std::endl;
+    auto cached = executable_cache.find(name);
+    if (cached != executable_cache.end()) return cached->second;
+
+    size_t start = 0;
+    while (start <= path.length()) {
+        size_t end = path.find(':', start);
+        if (end == std::string::npos) end = path.length();
+        std::string dir = end > start ? path.substr(start, end - start) : ".";
+        std::string candidate = dir + "/" + name;
+
+        struct stat st;
+        if (stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(candidate.c_str(), X_OK) == 0) {
+            executable_cache[name] = candidate;
+            return candidate;
         }
-    } catch (const fs::filesystem_error& e) {
-        show_error("Filesystem error: " + std::string(e.what()));
-    } catch (...) {
-        show_error("Failed to list directory contents.");
+        start = end + 1;
     }
+    return "";
 }
 
-void create_directory(const std::string &path) {
-    try {
-        if (fs::create_directory(path)) {
-            std::cout << "Directory created: " << path << std::endl;
+// Turn a command line into stages, falling back to /bin/sh -c when the engine
+// cannot run it natively (shell syntax, shell builtins, unknown commands).
+std::vector<PipelineStage> build_pipeline(const std::string &cmd) {
+    std::vector<PipelineStage> stages;
+    bool native = parse_pipeline(cmd, stages);
+    for (size_t i = 0; native && i < stages.size(); i++) {
+        PipelineStage &stage = stages[i];
+        if (stage.argv[0].find('=') != std::string::npos) {
+            native = false; // VAR=value prefix
         } else {
-            show_error("Failed to create directory: " + path);
+            stage.path = resolve_executable(stage.argv[0]);
+            native = !stage.path.empty();
         }
-    } catch (const fs::filesystem_error& e) {
-        show_error("Filesystem error: " + std::string(e.what()));
-    } catch (...) {
-        show_error("Error creating directory: " + path);
     }
+
+    if (!native) {
+        stages.assign(1, PipelineStage{{"/bin/sh", "-c", cmd}, "/bin/sh"});
+    }
+    return stages;
 }
 
-void remove_file_or_directory(const std::string &path) {
-    try {
-        if (fs::is_directory(path)) {
-            std::cout << "Removing directory: " << path << std::endl;
-            std::uintmax_t n = fs::remove_all(path);
-            std::cout << "Removed " << n << " files/directories" << std::endl;
-        } else {
-            if (fs::remove(path)) {
-                std::cout << "File removed: " << path << std::endl;
-            } else {
-                show_error("Failed to remove file: " + path);
-            }
+// Report a problem from code that may run on a worker thread: with `error`
+// set the message is collected there for the caller to report later.
+void report_error(const std::string &msg, std::string *error) {
+    if (error) error->append(msg) += '\n';
+    else show_error(msg);
+}
+
+// Start every stage with its stdout wired to the next stage's stdin; the last
+// stage writes to outFd. Returns the pids of the processes that were started.
+std::vector<pid_t> spawn_pipeline(const std::vector<PipelineStage> &stages, int outFd, std::string *error = nullptr) {
+    std::vector<pid_t> pids;
+    int inFd = -1;
+
+    for (size_t i = 0; i < stages.size(); i++) {
+        bool last = i + 1 == stages.size();
+        int pipeFds[2] = {-1, -1};
+        if (!last && pipe2(pipeFds, O_CLOEXEC) != 0) {
+            report_error("Failed to create pipe: " + std::string(strerror(errno)), error);
+            break;
         }
-    } catch (const fs::filesystem_error& e) {
-        show_error("Filesystem error: " + std::string(e.what()));
-    } catch (...) {
-        show_error("Error deleting file: " + path);
+        int stageOut = last ? outFd : pipeFds[1];
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        if (inFd != -1) posix_spawn_file_actions_adddup2(&actions, inFd, STDIN_FILENO);
+        if (stageOut != STDOUT_FILENO) posix_spawn_file_actions_adddup2(&actions, stageOut, STDOUT_FILENO);
+
+        std::vector<char*> argv;
+        for (const std::string &arg : stages[i].argv) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+
+        pid_t pid;
+        int err = posix_spawn(&pid, stages[i].path.c_str(), &actions, nullptr, argv.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+
+        if (inFd != -1) close(inFd);
+        if (!last) close(pipeFds[1]);
+        inFd = pipeFds[0];
+
+        if (err != 0) {
+            report_error("Failed to start " + stages[i].argv[0] + ": " + strerror(err), error);
+            break;
+        }
+        pids.push_back(pid);
     }
+
+    if (inFd != -1) close(inFd);
+    return pids;
 }
 
-// Import External Scripts
-void import_script(const std::string &filename) {
-    std::ifstream file(filename);
-    if (!file.is_open()) {
-        show_error("Failed to import script: " + filename);
-        return;
+// Wait for all processes of a pipeline. Returns the exit code of the last
+// stage, 128+signal if it was killed, or 127 if it never started.
+int wait_pipeline(const std::vector<pid_t> &pids, size_t stageCount) {
+    int status = 0;
+    for (pid_t pid : pids) {
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
     }
-    std::vector<std::string> lines;
-    std::string line;
-    while (std::getline(file, line)) {
-        if (!line.empty() && line[0] != '#') { // Skip comments
-            lines.push_back(line);
+    if (pids.size() < stageCount) return 127;
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return status;
+}
+
+// Read everything from fd into out. Data is read straight into the string's
+// storage, which grows geometrically, so large outputs are copied only once.
+bool read_fd(int fd, std::string &out) {
+    size_t used = out.size();
+    for (;;) {
+        if (out.size() - used < 65536) {
+            out.resize(std::max(out.size() * 2, used + 65536));
+        }
+        ssize_t n = read(fd, &out[used], out.size() - used);
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            out.resize(used);
+            return false;
+        }
+        used += n;
+    }
+    out.resize(used);
+    return true;
+}
+
+// Run a pipeline and append its output to `output`. Returns its status, or
+// -1 if it could not be started.
+int run_pipeline_captured(const std::string &cmd, const std::vector<PipelineStage> &stages,
+                          std::string &output, std::string *error = nullptr) {
+    int pipeFds[2];
+    if (pipe2(pipeFds, O_CLOEXEC) != 0) {
+        report_error("Command failed to start: " + cmd, error);
+        return -1;
+    }
+
+    std::vector<pid_t> pids = spawn_pipeline(stages, pipeFds[1], error);
+    close(pipeFds[1]);
+
+    if (!read_fd(pipeFds[0], output)) {
+        report_error("Error reading command output: " + cmd, error);
+    }
+    close(pipeFds[0]);
+
+    return wait_pipeline(pids, stages.size());
+}
+
+// Execute External Commands with output capture
+std::string execute_command(const std::string &cmd) {
+    std::string result;
+    int status = run_pipeline_captured(cmd, build_pipeline(cmd), result);
+    if (status < 0) return "Error executing command";
+    if (status != 0) {
+        show_error("Command exited with status " + std::to_string(status) + ": " + cmd);
+    }
+
+    return result;
+}
+
+// Run an external command with its output going straight to the terminal
+int run_external_command(const std::string &cmd) {
+    if (capture_depth > 0) {
+        std::cout << execute_command(cmd);
+        return 0;
+    }
+    std::cout.flush();
+    fflush(stdout);
+
+    std::vector<PipelineStage> stages = build_pipeline(cmd);
+    int status = wait_pipeline(spawn_pipeline(stages, STDOUT_FILENO), stages.size());
+    if (status != 0) {
+        show_error("Command exited with status " + std::to_string(status) + ": " + cmd);
+    }
+    return status;
+}
+
+// Background Jobs
+// `cmd &` starts a command without waiting for it. Its output still goes to
+// the terminal. Finished jobs are reported before the next prompt.
+struct Job {
+    int id;
+    std::string command;
+    std::vector<pid_t> pids; // processes not reaped yet
+    pid_t lastPid;           // its status is the job's status
+    int status = 0;
+};
+
+std::vector<Job> jobs;
+
+// Reap whatever has exited; with `block` wait until the whole job is done
+bool update_job(Job &job, bool block) {
+    for (auto it = job.pids.begin(); it != job.pids.end();) {
+        int status;
+        pid_t pid = waitpid(*it, &status, block ? 0 : WNOHANG);
+        if (pid < 0 && errno == EINTR) continue;
+        if (pid == 0) {
+            ++it;
+            continue;
+        }
+        if (pid == job.lastPid) {
+            if (WIFEXITED(status)) job.status = WEXITSTATUS(status);
+            else if (WIFSIGNALED(status)) job.status = 128 + WTERMSIG(status);
+        }
+        it = job.pids.erase(it); // reaped, or not our child any more
+    }
+    return job.pids.empty();
+}
+
+void start_background_job(const std::string &cmd) {
+    std::cout.flush();
+    fflush(stdout);
+
+    std::vector<PipelineStage> stages = build_pipeline(cmd);
+    std::vector<pid_t> pids = spawn_pipeline(stages, STDOUT_FILENO);
+    if (pids.size() < stages.size()) {
+        for (pid_t pid : pids) waitpid(pid, nullptr, 0);
+        last_status = 127;
+        return;
+    }
+
+    int id = jobs.empty() ? 1 : jobs.back().id + 1;
+    jobs.push_back({id, cmd, pids, pids.back()});
+    std::cout << "[" << id << "] " << pids.back() << std::endl;
+    last_status = 0;
+}
+
+std::string job_state(const Job &job) {
+    if (!job.pids.empty()) return "Running";
+    return job.status == 0 ? "Done" : "Exit " + std::to_string(job.status);
+}
+
+// Print and forget jobs that have finished
+void report_finished_jobs() {
+    for (auto it = jobs.begin(); it != jobs.end();) {
+        if (update_job(*it, false)) {
+            std::cout << "[" << it->id << "] " << job_state(*it) << "\t" << it->command << std::endl;
+            it = jobs.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Find a job by number, written as `2` or `%2`; the latest job if empty
+std::vector<Job>::iterator find_job(std::string_view spec) {
+    if (spec.empty()) return jobs.empty() ? jobs.end() : jobs.end() - 1;
+    if (spec[0] == '%') spec.remove_prefix(1);
+    int id = std::atoi(std::string(spec).c_str());
+    return std::find_if(jobs.begin(), jobs.end(), [id](const Job &job) { return job.id == id; });
+}
+
+// Wait for a job and forget it; returns its status
+int wait_job(std::vector<Job>::iterator job) {
+    update_job(*job, true);
+    int status = job->status;
+    jobs.erase(job);
+    return status;
+}
+#endif
+
+// Open File Cache
+// `write` and `append` keep the last few files they used open and buffer
+// what they write, so a loop appending to a report does not reopen the file
+// for every line. Buffers are flushed by `sync`, when a script finishes and
+// when the shell exits; files are closed before external commands run so
+// those see the data and can rename or delete the files freely.
+constexpr size_t kOpenFileLimit = 8;
+constexpr size_t kWriteBufferSize = 64 * 1024;
+
+struct OpenFile {
+    std::string key; // absolute path
+    int fd;
+    std::string pending;
+};
+
+std::vector<OpenFile> open_files; // least recently used first
+
+// Files mapped by `read`, so they can be detached before being overwritten
+std::unordered_map<std::string, std::weak_ptr<MappedFile>> mapped_files;
+
+#ifdef _WIN32
+int open_for_append(const std::string &path) {
+    return _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_APPEND | _O_TEXT, _S_IREAD | _S_IWRITE);
+}
+
+bool write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        int n = _write(fd, data, static_cast<unsigned int>(std::min<size_t>(size, 1u << 30)));
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool truncate_file(int fd) { return _chsize(fd, 0) == 0; }
+void close_file(int fd) { _close(fd); }
+#else
+int open_for_append(const std::string &path) {
+    return open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+}
+
+bool write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool truncate_file(int fd) { return ftruncate(fd, 0) == 0; }
+void close_file(int fd) { close(fd); }
+#endif
+
+std::string file_key(const std::string &filename) {
+    std::error_code ec;
+    fs::path path = fs::absolute(filename, ec);
+    return ec ? filename : path.lexically_normal().string();
+}
+
+bool flush_open_file(OpenFile &file) {
+    bool ok = write_all(file.fd, file.pending.data(), file.pending.size());
+    file.pending.clear();
+    if (!ok) show_error("Cannot write to file: " + file.key);
+    return ok;
+}
+
+void sync_open_files() {
+    for (OpenFile &file : open_files) {
+        if (!file.pending.empty()) flush_open_file(file);
+    }
+}
+
+void close_open_files() {
+    for (OpenFile &file : open_files) {
+        if (!file.pending.empty()) flush_open_file(file);
+        close_file(file.fd);
+    }
+    open_files.clear();
+}
+
+// Flush and close one file, e.g. before it is read or replaced
+void close_open_file(const std::string &key) {
+    for (auto it = open_files.begin(); it != open_files.end(); ++it) {
+        if (it->key == key) {
+            if (!it->pending.empty()) flush_open_file(*it);
+            close_file(it->fd);
+            open_files.erase(it);
+            return;
+        }
+    }
+}
+
+// Copy out a mapped file's contents before the file is rewritten
+void detach_mapping(const std::string &key) {
+    auto it = mapped_files.find(key);
+    if (it == mapped_files.end()) return;
+    if (std::shared_ptr<MappedFile> mapped = it->second.lock()) mapped->detach();
+    mapped_files.erase(it);
+}
+
+// Before a command that could truncate any file runs: a mapped file that
+// shrinks under its mapping would fault on the next access
+void detach_mappings() {
+    for (auto &entry : mapped_files) {
+        if (std::shared_ptr<MappedFile> mapped = entry.second.lock()) mapped->detach();
+    }
+    mapped_files.clear();
+}
+
+// Flush and close the shell's files and detach the mapped ones before
+// external commands run
+void release_files() {
+    close_open_files();
+    detach_mappings();
+}
+
+OpenFile* get_open_file(const std::string &filename) {
+    std::string key = file_key(filename);
+    for (auto it = open_files.begin(); it != open_files.end(); ++it) {
+        if (it->key == key) {
+            std::rotate(it, it + 1, open_files.end());
+            return &open_files.back();
+        }
+    }
+
+    int fd = open_for_append(key);
+    if (fd < 0) return nullptr;
+    if (open_files.size() == kOpenFileLimit) {
+        OpenFile &oldest = open_files.front();
+        if (!oldest.pending.empty()) flush_open_file(oldest);
+        close_file(oldest.fd);
+        open_files.erase(open_files.begin());
+    }
+    open_files.push_back({std::move(key), fd, std::string()});
+    return &open_files.back();
+}
+
+void buffer_write(OpenFile &file, std::string_view content) {
+    file.pending += content;
+    if (file.pending.size() >= kWriteBufferSize) flush_open_file(file);
+}
+
+// File Handling with error checking
+std::string read_file(const std::string &filename) {
+    if (!open_files.empty()) close_open_file(file_key(filename));
+
+    std::ifstream file(filename);
+    if (!file) {
+        show_error("File not found: " + filename);
+        return "";
+    }
+    // Read straight into the result when the size is known; tellg() means
+    // nothing for directories, pipes and devices, so those are streamed
+    std::string content;
+    std::error_code error;
+    std::streamoff size = 0;
+    if (fs::is_regular_file(filename, error)) {
+        file.seekg(0, std::ios::end);
+        size = file.tellg();
+        file.seekg(0, std::ios::beg);
+    }
+    if (size > 0) {
+        content.resize(static_cast<size_t>(size));
+        file.read(&content[0], size);
+        content.resize(static_cast<size_t>(file.gcount()));
+    } else {
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        content = buffer.str();
+    }
+    return content;
+}
+
+#ifndef _WIN32
+// Files at least this large are mapped by `read` instead of copied
+constexpr off_t kMapThreshold = 64 * 1024;
+
+std::shared_ptr<MappedFile> map_file(const std::string &filename) {
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= kMapThreshold) {
+        data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) return nullptr;
+    return std::make_shared<MappedFile>(static_cast<const char*>(data), static_cast<size_t>(st.st_size));
+}
+#endif
+
+// Load a file for `read`: large files are mapped, small ones copied
+Value load_file(const std::string &filename) {
+#ifndef _WIN32
+    std::string key = file_key(filename);
+    if (!open_files.empty()) close_open_file(key);
+    if (std::shared_ptr<MappedFile> mapped = map_file(filename)) {
+        // Forget mappings no variable holds any more
+        for (auto it = mapped_files.begin(); it != mapped_files.end();) {
+            it = it->second.expired() ? mapped_files.erase(it) : std::next(it);
+        }
+        detach_mapping(key);
+        mapped_files[key] = mapped;
+        return Value(std::move(mapped));
+    }
+#endif
+    return read_file(filename);
+}
+
+void write_file(const std::string &filename, const std::string &content) {
+    OpenFile* file = get_open_file(filename);
+    if (!file) {
+        show_error("Cannot write to file: " + filename);
+        return;
+    }
+    detach_mapping(file->key);
+    file->pending.clear();
+    if (!truncate_file(file->fd)) {
+        show_error("Cannot write to file: " + filename);
+        return;
+    }
+    buffer_write(*file, content);
+    std::cout << "Content written to " << filename << std::endl;
+}
+
+void append_file(const std::string &filename, const std::string &content) {
+    OpenFile* file = get_open_file(filename);
+    if (!file) {
+        show_error("Cannot append to file: " + filename);
+        return;
+    }
+    buffer_write(*file, content);
+    buffer_write(*file, "\n");
+    std::cout << "Content appended to " << filename << std::endl;
+}
+
+// Directory Commands
+void change_directory(const Args &tokens) {
+    if (tokens.size() < 2) {
+        show_error("Usage: cd <directory>");
+        return;
+    }
+    try {
+        fs::current_path(tokens[1]);
+        std::cout << "Changed directory to: " << fs::current_path().string() << std::endl;
+    } catch (const fs::filesystem_error& e) {
+        show_error("Directory error: " + std::string(e.what()));
+    } catch (...) {
+        show_error("Directory not found: " + std::string(tokens[1]));
+    }
+}
+
+// Directory Listing
+// Entries are read in large batches (getdents64 on Linux) and typed from
+// d_type without a stat. Size and modification time cost one statx per
+// entry, made only when -l, -S or -t asks for them. Names live in one arena
+// and the rows are rendered into a single buffer written at once.
+struct ListOptions {
+    bool all = false;        // -a: include dot files
+    bool longFormat = false; // -l: size, type and modification time
+    bool recursive = false;  // -R
+    bool reverse = false;    // -r
+    char sort = 'n';         // name, 'S'ize or 't'ime
+
+    bool needs_stat() const { return longFormat || sort != 'n'; }
+};
+
+enum class EntryType : uint8_t { File, Dir, Link, Other, Unknown };
+
+struct ListEntry {
+    uint32_t nameOffset; // into DirectoryListing::names, NUL-terminated
+    uint32_t nameLength;
+    EntryType type;
+    uint64_t size = 0;
+    int64_t mtime = 0;
+};
+
+struct DirectoryListing {
+    std::string names;
+    std::vector<ListEntry> entries;
+
+    std::string_view name(const ListEntry &entry) const { return {names.data() + entry.nameOffset, entry.nameLength}; }
+
+    ListEntry &add(std::string_view name, EntryType type) {
+        ListEntry entry{static_cast<uint32_t>(names.size()), static_cast<uint32_t>(name.size()), type};
+        names.append(name.data(), name.size());
+        names.push_back('\0');
+        entries.push_back(entry);
+        return entries.back();
+    }
+};
+
+bool skip_entry(std::string_view name, const ListOptions &options) {
+    if (name == "." || name == "..") return true;
+    return !options.all && name[0] == '.';
+}
+
+#ifndef _WIN32
+EntryType entry_type_from_mode(mode_t mode) {
+    if (S_ISREG(mode)) return EntryType::File;
+    if (S_ISDIR(mode)) return EntryType::Dir;
+    if (S_ISLNK(mode)) return EntryType::Link;
+    return EntryType::Other;
+}
+
+EntryType entry_type_from_dirent(unsigned char type) {
+    switch (type) {
+        case DT_REG: return EntryType::File;
+        case DT_DIR: return EntryType::Dir;
+        case DT_LNK: return EntryType::Link;
+        case DT_UNKNOWN: return EntryType::Unknown;
+        default: return EntryType::Other;
+    }
+}
+
+// Fill in size and time, and the type where d_type could not tell it
+void stat_entry(int dirFd, const char* name, ListEntry &entry) {
+#if defined(__linux__) && defined(STATX_SIZE)
+    struct statx info;
+    if (statx(dirFd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_TYPE | STATX_SIZE | STATX_MTIME, &info) != 0) return;
+    entry.size = info.stx_size;
+    entry.mtime = info.stx_mtime.tv_sec;
+    if (entry.type == EntryType::Unknown) entry.type = entry_type_from_mode(info.stx_mode);
+#else
+    struct stat info;
+    if (fstatat(dirFd, name, &info, AT_SYMLINK_NOFOLLOW) != 0) return;
+    entry.size = info.st_size;
+    entry.mtime = info.st_mtime;
+    if (entry.type == EntryType::Unknown) entry.type = entry_type_from_mode(info.st_mode);
+#endif
+}
+
+// Read the names and d_types of an open directory
+bool read_entries(int fd, const ListOptions &options, DirectoryListing &out) {
+#ifdef __linux__
+    struct LinuxDirent64 {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[1];
+    };
+    std::vector<char> buffer(1 << 17);
+    long bytes;
+    while ((bytes = syscall(SYS_getdents64, fd, buffer.data(), buffer.size())) > 0) {
+        for (long pos = 0; pos < bytes;) {
+            const auto* dirent = reinterpret_cast<const LinuxDirent64*>(buffer.data() + pos);
+            pos += dirent->d_reclen;
+            std::string_view name(dirent->d_name);
+            if (!skip_entry(name, options)) out.add(name, entry_type_from_dirent(dirent->d_type));
+        }
+    }
+    return bytes == 0;
+#else
+    DIR* dir = fdopendir(dup(fd));
+    if (!dir) return false;
+    while (const dirent* entry = readdir(dir)) {
+        std::string_view name(entry->d_name);
+        if (!skip_entry(name, options)) out.add(name, entry_type_from_dirent(entry->d_type));
+    }
+    closedir(dir);
+    return true;
+#endif
+}
+
+bool read_directory(const std::string &path, const ListOptions &options, DirectoryListing &out) {
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return false;
+    if (!read_entries(fd, options, out)) {
+        close(fd);
+        return false;
+    }
+    for (ListEntry &entry : out.entries) {
+        if (options.needs_stat() || entry.type == EntryType::Unknown) {
+            stat_entry(fd, out.names.data() + entry.nameOffset, entry);
+            if (entry.type == EntryType::Dir) entry.size = 0; // shown as "-", sorted as empty
+        }
+    }
+    close(fd);
+    return true;
+}
+#else
+bool read_directory(const std::string &path, const ListOptions &options, DirectoryListing &out) {
+    std::error_code error;
+    fs::directory_iterator it(path, error);
+    if (error) return false;
+    for (const fs::directory_entry &item : it) {
+        std::string name = item.path().filename().string();
+        if (skip_entry(name, options)) continue;
+        // Windows fills in the type, size and time while iterating
+        fs::file_status status = item.symlink_status(error);
+        EntryType type = fs::is_directory(status) ? EntryType::Dir
+                       : fs::is_regular_file(status) ? EntryType::File
+                       : fs::is_symlink(status) ? EntryType::Link : EntryType::Other;
+        ListEntry &entry = out.add(name, type);
+        if (!options.needs_stat()) continue;
+        if (type == EntryType::File) entry.size = item.file_size(error);
+        auto written = item.last_write_time(error);
+        auto system = std::chrono::time_point_cast<std::chrono::system_clock::duration>(
+            written - fs::file_time_type::clock::now() + std::chrono::system_clock::now());
+        entry.mtime = std::chrono::system_clock::to_time_t(system);
+    }
+    return true;
+}
+#endif
+
+void sort_listing(DirectoryListing &listing, const ListOptions &options) {
+    auto by_name = [&](const ListEntry &a, const ListEntry &b) { return listing.name(a) < listing.name(b); };
+    auto &entries = listing.entries;
+    if (options.sort == 'S') {
+        std::sort(entries.begin(), entries.end(), [&](const ListEntry &a, const ListEntry &b) {
+            return a.size != b.size ? a.size > b.size : by_name(a, b);
+        });
+    } else if (options.sort == 't') {
+        std::sort(entries.begin(), entries.end(), [&](const ListEntry &a, const ListEntry &b) {
+            return a.mtime != b.mtime ? a.mtime > b.mtime : by_name(a, b);
+        });
+    } else {
+        std::sort(entries.begin(), entries.end(), by_name);
+    }
+    if (options.reverse) std::reverse(entries.begin(), entries.end());
+}
+
+void pad_to(std::string &out, size_t lineStart, size_t width) {
+    size_t used = out.size() - lineStart;
+    out.append(used < width ? width - used : 1, ' ');
+}
+
+void render_listing(const std::string &title, const DirectoryListing &listing, const ListOptions &options, std::string &out) {
+    constexpr size_t nameColWidth = 30;
+    constexpr size_t sizeColWidth = 12;
+    constexpr size_t typeColWidth = 7;
+
+    out += "Contents of ";
+    out += title;
+    out += ":\n";
+    if (!options.longFormat) {
+        for (const ListEntry &entry : listing.entries) {
+            out += listing.name(entry);
+            if (entry.type == EntryType::Dir) out += '/';
+            out += '\n';
+        }
+        return;
+    }
+
+    size_t line = out.size();
+    out += "Name";
+    pad_to(out, line, nameColWidth);
+    out += "Size";
+    pad_to(out, line, nameColWidth + sizeColWidth);
+    out += "Type";
+    pad_to(out, line, nameColWidth + sizeColWidth + typeColWidth);
+    out += "Modified\n";
+    out.append(nameColWidth + sizeColWidth + typeColWidth + 16, '-');
+    out += '\n';
+
+    static constexpr const char* type_names[] = {"File", "Dir", "Link", "Other", "?"};
+    // Entries written together share a minute, so reuse the last stamp
+    int64_t stampMinute = -1;
+    char stamp[20];
+    size_t stampLength = 0;
+    for (const ListEntry &entry : listing.entries) {
+        line = out.size();
+        out += listing.name(entry);
+        pad_to(out, line, nameColWidth);
+        if (entry.type == EntryType::Dir) {
+            out += '-';
+        } else {
+            char digits[24];
+            out.append(digits, std::to_chars(digits, digits + sizeof(digits), entry.size).ptr);
+            out += 'B';
+        }
+        pad_to(out, line, nameColWidth + sizeColWidth);
+        out += type_names[static_cast<int>(entry.type)];
+        pad_to(out, line, nameColWidth + sizeColWidth + typeColWidth);
+        if (entry.mtime / 60 != stampMinute) {
+            stampMinute = entry.mtime / 60;
+            std::tm tm_buf = local_time(static_cast<std::time_t>(entry.mtime));
+            stampLength = strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M", &tm_buf);
+        }
+        out.append(stamp, stampLength);
+        out += '\n';
+    }
+}
+
+void flush_listing(std::string &out) {
+    std::cout.write(out.data(), static_cast<std::streamsize>(out.size()));
+    std::cout.flush();
+    out.clear();
+}
+
+std::string join_path(const std::string &dir, std::string_view name) {
+    return !dir.empty() && dir.back() == '/' ? dir + std::string(name) : dir + "/" + std::string(name);
+}
+
+void list_tree(const std::string &path, const std::string &title, const ListOptions &options, std::string &out) {
+    DirectoryListing listing;
+    if (!read_directory(path, options, listing)) {
+        flush_listing(out);
+        show_error("Cannot list directory: " + title);
+        return;
+    }
+    sort_listing(listing, options);
+    render_listing(title, listing, options, out);
+    if (!options.recursive) return;
+
+    // Keep memory bounded on huge trees while still writing in large blocks
+    if (out.size() > (1u << 20)) flush_listing(out);
+    for (const ListEntry &entry : listing.entries) {
+        if (entry.type != EntryType::Dir) continue;
+        out += '\n';
+        list_tree(join_path(path, listing.name(entry)), join_path(title, listing.name(entry)), options, out);
+    }
+}
+
+void list_directory(const std::string &path, const ListOptions &options) {
+    std::string title = path;
+    if (path == ".") {
+        std::error_code error;
+        title = fs::current_path(error).string();
+    }
+    std::string out;
+    list_tree(path, title, options, out);
+    flush_listing(out);
+}
+
+void create_directory(const std::string &path) {
+    try {
+        if (fs::create_directory(path)) {
+            std::cout << "Directory created: " << path << std::endl;
+        } else {
+            show_error("Failed to create directory: " + path);
+        }
+    } catch (const fs::filesystem_error& e) {
+        show_error("Filesystem error: " + std::string(e.what()));
+    } catch (...) {
+        show_error("Error creating directory: " + path);
+    }
+}
+
+#ifndef _WIN32
+// Tree Removal
+// Directories are removed with work stealing: each worker takes directories
+// from the back of its own deque (depth first) and steals from the front of
+// another worker's deque when its own runs dry. The calling thread is the
+// first worker; pool threads join only while there is queued work to share,
+// and idle workers sleep on a condition variable. Every directory is opened
+// with openat relative to its parent's descriptor, which stays open until
+// all of its children are gone, so path length never limits the depth and a
+// directory swapped for a symlink mid-walk is never followed. Files are
+// unlinked relative to the open directory; a directory is removed by
+// whichever worker finishes its last child. An entry that cannot be removed
+// keeps its ancestors in place, but the rest of the tree is still removed.
+class TreeRemover {
+public:
+    explicit TreeRemover(size_t workers) : queues_(std::max<size_t>(workers, 1)) {}
+
+    void run(const std::string &root) {
+        // Every directory on the way down holds a descriptor
+        rlimit saved;
+        bool raised = getrlimit(RLIMIT_NOFILE, &saved) == 0 && saved.rlim_cur < saved.rlim_max;
+        if (raised) {
+            rlimit wide = saved;
+            wide.rlim_cur = wide.rlim_max;
+            raised = setrlimit(RLIMIT_NOFILE, &wide) == 0;
+        }
+
+        // Progress is for people watching a terminal, not for captured output
+        progress_ = isatty(STDOUT_FILENO) && capture_depth == 0;
+        lastProgress_ = std::chrono::steady_clock::now();
+        push(0, std::make_shared<Dir>(root, nullptr));
+        work(0);
+        std::vector<std::future<void>> helpers;
+        {
+            std::lock_guard<std::mutex> lock(idleMutex_);
+            helpers.swap(helpers_);
+        }
+        for (std::future<void> &helper : helpers) helper.wait();
+        if (progress_) std::cout << "\r\033[K";
+
+        if (raised) setrlimit(RLIMIT_NOFILE, &saved);
+    }
+
+    size_t removed() const { return removed_; }
+    size_t failures() const { return failures_; }
+    const std::vector<std::string> &errors() const { return errors_; }
+
+private:
+    struct Dir {
+        Dir(std::string name, std::shared_ptr<Dir> parent) : name(std::move(name)), parent(std::move(parent)) {}
+
+        std::string name;               // relative to the parent; the root's own path
+        std::shared_ptr<Dir> parent;
+        int fd = -1;                    // open until its last child is gone
+        std::atomic<size_t> pending{1}; // its own files plus live subdirectories
+        std::atomic<bool> keep{false};  // something below could not be removed
+
+        int parent_fd() const { return parent ? parent->fd : AT_FDCWD; }
+
+        // For error messages only
+        std::string path() const { return parent ? join_path(parent->path(), name) : name; }
+    };
+
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<std::shared_ptr<Dir>> dirs;
+    };
+
+    void push(size_t worker, std::shared_ptr<Dir> dir) {
+        outstanding_++;
+        {
+            std::lock_guard<std::mutex> lock(queues_[worker].mutex);
+            queues_[worker].dirs.push_back(std::move(dir));
+        }
+        std::lock_guard<std::mutex> lock(idleMutex_);
+        queued_++;
+        // Work beyond what this worker is about to take: wake or add a helper
+        if (idle_ > 0) {
+            wake_.notify_one();
+        } else if (queued_ > 1 && 1 + helpers_.size() < queues_.size()) {
+            size_t helper = 1 + helpers_.size();
+            helpers_.push_back(worker_pool().submit([this, helper] { work(helper); }));
+        }
+    }
+
+    std::shared_ptr<Dir> take(size_t worker) {
+        for (size_t i = 0; i < queues_.size(); i++) {
+            WorkQueue &queue = queues_[(worker + i) % queues_.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.dirs.empty()) continue;
+            std::shared_ptr<Dir> dir;
+            if (i == 0) {
+                dir = std::move(queue.dirs.back());
+                queue.dirs.pop_back();
+            } else {
+                dir = std::move(queue.dirs.front());
+                queue.dirs.pop_front();
+            }
+            queued_--;
+            return dir;
+        }
+        return nullptr;
+    }
+
+    void work(size_t worker) {
+        for (;;) {
+            std::shared_ptr<Dir> dir = take(worker);
+            if (!dir) {
+                std::unique_lock<std::mutex> lock(idleMutex_);
+                idle_++;
+                wake_.wait(lock, [this] { return outstanding_ == 0 || queued_ > 0; });
+                idle_--;
+                if (outstanding_ == 0) return;
+                continue;
+            }
+            empty_directory(worker, dir);
+            if (--outstanding_ == 0) {
+                std::lock_guard<std::mutex> lock(idleMutex_);
+                wake_.notify_all();
+            }
+            if (worker == 0 && progress_) show_progress();
+        }
+    }
+
+    void show_progress() {
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastProgress_ < std::chrono::milliseconds(200)) return;
+        lastProgress_ = now;
+        std::cout << "\rRemoved " << removed_ << " entries..." << std::flush;
+    }
+
+    void empty_directory(size_t worker, const std::shared_ptr<Dir> &dir) {
+        dir->fd = openat(dir->parent_fd(), dir->name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        DirectoryListing listing;
+        ListOptions options;
+        options.all = true;
+        if (dir->fd < 0 || !read_entries(dir->fd, options, listing)) {
+            fail(*dir);
+            dir->keep = true;
+            finish(dir);
+            return;
+        }
+
+        // Hand out the subdirectories first so idle workers can start on them
+        for (ListEntry &entry : listing.entries) {
+            const char* name = listing.names.data() + entry.nameOffset;
+            if (entry.type == EntryType::Unknown) stat_entry(dir->fd, name, entry);
+            if (entry.type != EntryType::Dir) continue;
+            dir->pending++;
+            push(worker, std::make_shared<Dir>(name, dir));
+        }
+        for (const ListEntry &entry : listing.entries) {
+            if (entry.type == EntryType::Dir) continue;
+            const char* name = listing.names.data() + entry.nameOffset;
+            if (unlinkat(dir->fd, name, 0) == 0) {
+                removed_++;
+            } else {
+                fail(*dir, name);
+                dir->keep = true;
+            }
+        }
+        finish(dir);
+    }
+
+    // Drop one pending count, removing every directory that becomes empty
+    void finish(std::shared_ptr<Dir> dir) {
+        while (dir && --dir->pending == 0) {
+            if (dir->fd >= 0) {
+                close(dir->fd);
+                dir->fd = -1;
+            }
+            if (!dir->keep) {
+                if (unlinkat(dir->parent_fd(), dir->name.c_str(), AT_REMOVEDIR) == 0) {
+                    removed_++;
+                } else {
+                    fail(*dir);
+                    dir->keep = true;
+                }
+            }
+            if (dir->keep && dir->parent) dir->parent->keep = true;
+            dir = dir->parent;
+        }
+    }
+
+    // Report errno for `dir`, or for its entry `name`
+    void fail(const Dir &dir, const char* name = nullptr) {
+        int error = errno;
+        std::string path = name ? join_path(dir.path(), name) : dir.path();
+        std::string message = path + ": " + std::strerror(error);
+        std::lock_guard<std::mutex> lock(errorsMutex_);
+        if (errors_.size() < kMaxErrors) errors_.push_back(std::move(message));
+        failures_++;
+    }
+
+    static constexpr size_t kMaxErrors = 10; // reported individually
+
+    std::vector<WorkQueue> queues_;
+    std::atomic<size_t> outstanding_{0}; // directories queued or being emptied
+    std::atomic<size_t> removed_{0};
+    std::atomic<size_t> queued_{0};      // directories waiting in the deques
+    std::mutex idleMutex_;               // guards idle_ and helpers_, and orders wake-ups
+    std::condition_variable wake_;
+    size_t idle_ = 0;                    // workers sleeping on wake_
+    std::vector<std::future<void>> helpers_;
+    bool progress_ = false;
+    std::chrono::steady_clock::time_point lastProgress_;
+    std::mutex errorsMutex_;
+    std::vector<std::string> errors_;
+    size_t failures_ = 0;
+};
+#endif
+
+void remove_file_or_directory(const std::string &path, bool force = false) {
+#ifndef _WIN32
+    struct stat info;
+    if (lstat(path.c_str(), &info) != 0) {
+        if (!force || errno != ENOENT) show_error("Cannot remove " + path + ": " + std::strerror(errno));
+        return;
+    }
+    if (!S_ISDIR(info.st_mode)) {
+        if (unlink(path.c_str()) == 0) {
+            std::cout << "File removed: " << path << std::endl;
+        } else {
+            show_error("Failed to remove file: " + path + ": " + std::strerror(errno));
+        }
+        return;
+    }
+
+    std::cout << "Removing directory: " << path << std::endl;
+    TreeRemover remover(worker_pool().size());
+    remover.run(path);
+    std::cout << "Removed " << remover.removed() << " files/directories" << std::endl;
+    if (remover.failures() > 0) {
+        for (const std::string &error : remover.errors()) show_error("Cannot remove " + error);
+        if (remover.failures() > remover.errors().size()) {
+            show_error("... and " + std::to_string(remover.failures() - remover.errors().size()) + " more entries could not be removed");
+        }
+    }
+#else
+    try {
+        if (force && !fs::exists(fs::symlink_status(path))) return;
+        if (fs::is_directory(path)) {
+            std::cout << "Removing directory: " << path << std::endl;
+            std::uintmax_t n = fs::remove_all(path);
+            std::cout << "Removed " << n << " files/directories" << std::endl;
+        } else {
+            if (fs::remove(path)) {
+                std::cout << "File removed: " << path << std::endl;
+            } else {
+                show_error("Failed to remove file: " + path);
+            }
+        }
+    } catch (const fs::filesystem_error& e) {
+        show_error("Filesystem error: " + std::string(e.what()));
+    } catch (...) {
+        show_error("Error deleting file: " + path);
+    }
+#endif
+}
+
+// Copying and Moving
+// A file is cloned with FICLONE where the filesystem can share extents
+// (btrfs, XFS), otherwise copied inside the kernel with copy_file_range,
+// falling back to a read/write loop. Directory trees are created on the
+// shell's thread and their files copied concurrently on the worker pool.
+// `mv` renames, and copies then removes only across filesystems.
+struct CopyJob {
+    std::string from;
+    std::string to;
+};
+
+// The results of copying or moving one argument
+struct CopyResult {
+    size_t files = 0;
+    std::vector<std::string> errors; // the first few, reported afterwards
+    size_t failures = 0;
+
+    void fail(std::string message) {
+        if (errors.size() < 10) errors.push_back(std::move(message));
+        failures++;
+    }
+
+    void report() const {
+        for (const std::string &error : errors) show_error(error);
+        if (failures > errors.size()) show_error("... and " + std::to_string(failures - errors.size()) + " more errors");
+    }
+};
+
+// `a/b/` names `b`
+std::string base_name(std::string path) {
+    while (path.size() > 1 && (path.back() == '/' || path.back() == '\\')) path.pop_back();
+    return fs::path(path).filename().string();
+}
+
+#ifndef _WIN32
+// Returns 0 or an errno value
+int copy_file_contents(const std::string &from, const std::string &to) {
+    int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) return errno;
+    struct stat info;
+    int out = fstat(in, &info) == 0 ? open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, info.st_mode & 07777) : -1;
+    if (out < 0) {
+        int error = errno;
+        close(in);
+        return error;
+    }
+
+    int error = 0;
+    bool done = false;
+    // Empty files, and those in /proc that only claim to be, go straight to
+    // the read loop, which costs a single read when there is nothing to copy
+    bool empty = info.st_size == 0;
+#ifdef FICLONE
+    done = !empty && ioctl(out, FICLONE, in) == 0;
+#endif
+#ifdef __linux__
+    while (!done && !empty) {
+        ssize_t n = copy_file_range(in, nullptr, out, nullptr, size_t(1) << 30, 0);
+        if (n == 0) {
+            done = true;
+        } else if (n < 0) {
+            if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) error = errno;
+            break;
+        }
+    }
+#endif
+    if (!done && error == 0) {
+        thread_local std::vector<char> buffer(1 << 20);
+        ssize_t n;
+        while ((n = read(in, buffer.data(), buffer.size())) > 0) {
+            for (ssize_t written = 0; written < n;) {
+                ssize_t w = write(out, buffer.data() + written, n - written);
+                if (w < 0) {
+                    error = errno;
+                    break;
+                }
+                written += w;
+            }
+            if (error) break;
+        }
+        if (n < 0) error = errno;
+    }
+    close(in);
+    if (close(out) != 0 && error == 0) error = errno;
+    return error;
+}
+
+// Create the directories of a tree now and collect its files as jobs.
+// Symbolic links inside a tree are copied as links.
+void plan_copy(const std::string &from, const std::string &to, bool recursive, bool followLinks,
+               std::vector<CopyJob> &jobs, CopyResult &result) {
+    struct stat info;
+    if ((followLinks ? stat(from.c_str(), &info) : lstat(from.c_str(), &info)) != 0) {
+        result.fail("Cannot copy " + from + ": " + std::strerror(errno));
+        return;
+    }
+    if (S_ISREG(info.st_mode)) {
+        jobs.push_back({from, to});
+        return;
+    }
+    if (S_ISLNK(info.st_mode)) {
+        std::vector<char> target(PATH_MAX);
+        ssize_t length = readlink(from.c_str(), target.data(), target.size() - 1);
+        if (length < 0) {
+            result.fail("Cannot read link " + from + ": " + std::strerror(errno));
+            return;
+        }
+        target[length] = '\0';
+        unlink(to.c_str());
+        if (symlink(target.data(), to.c_str()) != 0) {
+            result.fail("Cannot create link " + to + ": " + std::strerror(errno));
+        } else {
+            result.files++;
+        }
+        return;
+    }
+    if (!S_ISDIR(info.st_mode)) {
+        result.fail("Skipping special file " + from);
+        return;
+    }
+    if (!recursive) {
+        result.fail("Omitting directory " + from + " (use cp -r)");
+        return;
+    }
+
+    if (mkdir(to.c_str(), info.st_mode & 07777) != 0) {
+        struct stat existing;
+        if (errno != EEXIST || stat(to.c_str(), &existing) != 0 || !S_ISDIR(existing.st_mode)) {
+            result.fail("Cannot create directory " + to + ": " + std::strerror(errno));
+            return;
+        }
+    }
+    int fd = open(from.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DirectoryListing listing;
+    ListOptions options;
+    options.all = true;
+    bool listed = fd >= 0 && read_entries(fd, options, listing);
+    int error = errno;
+    if (fd >= 0) close(fd);
+    if (!listed) {
+        result.fail("Cannot read directory " + from + ": " + std::strerror(error));
+        return;
+    }
+    for (const ListEntry &entry : listing.entries) {
+        std::string_view name = listing.name(entry);
+        if (entry.type == EntryType::File) {
+            jobs.push_back({join_path(from, name), join_path(to, name)}); // d_type saved a stat
+        } else {
+            plan_copy(join_path(from, name), join_path(to, name), true, false, jobs, result);
+        }
+    }
+}
+
+// Copy the planned files, spreading them over the worker pool
+void run_copy_jobs(const std::vector<CopyJob> &jobs, CopyResult &result) {
+    // Destinations are truncated; copy out any that `read` has mapped
+    if (!mapped_files.empty()) {
+        for (const CopyJob &job : jobs) detach_mapping(file_key(job.to));
+    }
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> copied{0};
+    std::mutex errorsMutex;
+    auto copy_some = [&] {
+        for (size_t i = next++; i < jobs.size(); i = next++) {
+            int error = copy_file_contents(jobs[i].from, jobs[i].to);
+            if (error == 0) {
+                copied++;
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(errorsMutex);
+            result.fail("Cannot copy " + jobs[i].from + " to " + jobs[i].to + ": " + std::strerror(error));
+        }
+    };
+
+    if (jobs.size() == 1) {
+        copy_some();
+    } else {
+        std::vector<std::future<void>> done;
+        for (size_t i = 0; i < std::min(worker_pool().size(), jobs.size()); i++) done.push_back(worker_pool().submit(copy_some));
+        for (std::future<void> &worker : done) worker.wait();
+    }
+    result.files += copied;
+}
+
+bool same_file(const std::string &a, const std::string &b) {
+    struct stat first, second;
+    return stat(a.c_str(), &first) == 0 && stat(b.c_str(), &second) == 0 &&
+           first.st_dev == second.st_dev && first.st_ino == second.st_ino;
+}
+
+// Like cp, a symbolic link named as the source is followed only when not
+// copying recursively; otherwise the link itself is copied
+void copy_path(const std::string &from, const std::string &to, bool recursive, CopyResult &result) {
+    if (same_file(from, to)) {
+        result.fail(from + " and " + to + " are the same file");
+        return;
+    }
+    bool followLinks = !recursive;
+    // Copying a directory into itself would never finish
+    std::error_code error;
+    fs::path source = fs::weakly_canonical(from, error);
+    fs::path target = fs::weakly_canonical(to, error);
+    if (!error && fs::is_directory(source) && (followLinks || !fs::is_symlink(from, error))) {
+        auto mismatch = std::mismatch(source.begin(), source.end(), target.begin(), target.end());
+        if (mismatch.first == source.end()) {
+            result.fail("Cannot copy " + from + " into itself");
+            return;
+        }
+    }
+    std::vector<CopyJob> jobs;
+    plan_copy(from, to, recursive, followLinks, jobs, result);
+    run_copy_jobs(jobs, result);
+}
+
+// Across filesystems the source is copied recursively, so a moved link
+// stays a link
+void move_path(const std::string &from, const std::string &to, CopyResult &result) {
+    if (rename(from.c_str(), to.c_str()) == 0) {
+        result.files++;
+        return;
+    }
+    if (errno != EXDEV) {
+        result.fail("Cannot move " + from + " to " + to + ": " + std::strerror(errno));
+        return;
+    }
+    // Another filesystem: copy, and remove the source only if all of it arrived
+    size_t failures = result.failures;
+    copy_path(from, to, true, result);
+    if (result.failures != failures) return;
+    struct stat info;
+    if (lstat(from.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+        TreeRemover remover(worker_pool().size());
+        remover.run(from);
+        for (const std::string &error : remover.errors()) result.fail("Cannot remove " + error);
+    } else if (unlink(from.c_str()) != 0) {
+        result.fail("Cannot remove " + from + ": " + std::strerror(errno));
+    }
+}
+#else
+void copy_path(const std::string &from, const std::string &to, bool recursive, CopyResult &result) {
+    std::error_code error;
+    auto options = fs::copy_options::overwrite_existing;
+    if (recursive) options |= fs::copy_options::recursive | fs::copy_options::copy_symlinks;
+    if (!recursive && fs::is_directory(from, error)) {
+        result.fail("Omitting directory " + from + " (use cp -r)");
+        return;
+    }
+    fs::copy(from, to, options, error);
+    if (error) {
+        result.fail("Cannot copy " + from + " to " + to + ": " + error.message());
+    } else {
+        result.files++;
+    }
+}
+
+void move_path(const std::string &from, const std::string &to, CopyResult &result) {
+    std::error_code error;
+    fs::rename(from, to, error);
+    if (!error) {
+        result.files++;
+        return;
+    }
+    size_t failures = result.failures;
+    copy_path(from, to, true, result);
+    if (result.failures == failures) fs::remove_all(from, error);
+}
+#endif
+
+// Grep
+// Files are mapped (or read, when small) and scanned for a literal that every
+// match must contain, using memmem/memchr, which libc vectorizes. Only the
+// lines holding a candidate are checked against the regex. Files are
+// searched in batches on the worker pool and printed in argument order.
+struct GrepOptions {
+    bool ignoreCase = false;  // -i
+    bool lineNumbers = false; // -n
+    bool count = false;       // -c
+    bool filesOnly = false;   // -l
+    bool invert = false;      // -v
+    bool fixed = false;       // -F: the pattern is a plain string
+    bool recursive = false;   // -r
+    bool showNames = false;   // more than one file
+    std::string variable;     // -o: store the output instead of printing it
+};
+
+struct GrepResult {
+    std::string output;
+    size_t matches = 0;
+    std::string error;
+};
+
+// The longest run of characters that any match of `pattern` must contain,
+// or "" when there is none (e.g. a top-level alternation). Only top-level
+// text counts: groups may be optional or alternatives, so they end a run.
+std::string required_literal(std::string_view pattern) {
+    std::string best, run;
+    int depth = 0;
+    auto end_run = [&] {
+        if (depth == 0 && run.size() > best.size()) best = run;
+        run.clear();
+    };
+    for (size_t i = 0; i < pattern.size(); i++) {
+        char c = pattern[i];
+        switch (c) {
+        case '|':
+            if (depth == 0) return "";
+            break;
+        case '(':
+            end_run();
+            depth++;
+            break;
+        case ')':
+            end_run();
+            if (--depth < 0) return "";
+            break;
+        case '[':
+            end_run();
+            i = pattern.find(']', i + (i + 1 < pattern.size() && pattern[i + 1] == ']' ? 2 : 1));
+            if (i == std::string_view::npos) return "";
+            break;
+        case '*': case '?': case '{':
+            // The previous character is optional
+            if (!run.empty()) run.pop_back();
+            end_run();
+            if (c == '{') i = std::min(pattern.find('}', i), pattern.size());
+            break;
+        case '+':
+            end_run();
+            break;
+        case '.': case '^': case '$':
+            end_run();
+            break;
+        case '\\':
+            if (i + 1 < pattern.size() && std::ispunct(static_cast<unsigned char>(pattern[i + 1]))) {
+                run += pattern[++i];
+            } else {
+                end_run();
+                i++;
+            }
+            break;
+        default:
+            run += c;
+            break;
+        }
+    }
+    if (depth != 0) return "";
+    end_run();
+    return best;
+}
+
+class GrepMatcher {
+public:
+    GrepMatcher(const std::string &pattern, const GrepOptions &options) : options_(options) {
+        literalOnly_ = options.fixed || pattern.find_first_of("\\^$.|?*+()[]{}") == std::string::npos;
+        literal_ = literalOnly_ ? pattern : required_literal(pattern);
+        if (options.ignoreCase) {
+            for (char &c : literal_) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        }
+        if (!literalOnly_) {
+            auto flags = std::regex::ECMAScript | std::regex::optimize;
+            if (options.ignoreCase) flags |= std::regex::icase;
+            regex_ = std::regex(pattern, flags); // throws std::regex_error
+        }
+    }
+
+    // Runs on worker threads: touches nothing but its arguments
+    void search(std::string_view text, const std::string &name, GrepResult &out) const {
+        bool binary = std::memchr(text.data(), '\0', std::min<size_t>(text.size(), 8192)) != nullptr;
+        bool quiet = options_.count || options_.filesOnly || binary;
+        size_t lineNumber = 1;
+        size_t pos = 0;
+
+        auto emit = [&](size_t start, size_t end) {
+            out.matches++;
+            if (quiet) return;
+            if (options_.showNames) {
+                out.output += name;
+                out.output += ':';
+            }
+            if (options_.lineNumbers) {
+                out.output += std::to_string(lineNumber);
+                out.output += ':';
+            }
+            out.output.append(text.data() + start, end - start);
+            out.output += '\n';
+        };
+        auto line_end = [&](size_t start) {
+            const void* newline = std::memchr(text.data() + start, '\n', text.size() - start);
+            return newline ? static_cast<size_t>(static_cast<const char*>(newline) - text.data()) : text.size();
+        };
+        // Lines without a candidate cannot match; with -v each one is output
+        auto skip_to = [&](size_t target) {
+            while (pos < target) {
+                size_t end = line_end(pos);
+                if (options_.invert) emit(pos, end);
+                pos = end + 1;
+                lineNumber++;
+            }
+        };
+        auto count_lines_to = [&](size_t target) {
+            if (options_.invert) return skip_to(target);
+            if (options_.lineNumbers) lineNumber += std::count(text.data() + pos, text.data() + target, '\n');
+            pos = target;
+        };
+
+        while (pos < text.size()) {
+            size_t start = pos;
+            if (!literal_.empty()) {
+                size_t candidate = find_literal(text, pos);
+                if (candidate == std::string_view::npos) {
+                    count_lines_to(text.size());
+                    break;
+                }
+                start = candidate;
+                while (start > pos && text[start - 1] != '\n') start--;
+                count_lines_to(start);
+            }
+            size_t end = line_end(start);
+            bool matched = literalOnly_ || std::regex_search(text.data() + start, text.data() + end, regex_);
+            if (matched != options_.invert) {
+                emit(start, end);
+                if (options_.filesOnly) break;
+            }
+            pos = end + 1;
+            lineNumber++;
+        }
+
+        if (options_.count && !options_.filesOnly) {
+            out.output = (options_.showNames ? name + ":" : "") + std::to_string(out.matches) + "\n";
+        } else if (out.matches == 0) {
+            return;
+        } else if (options_.filesOnly) {
+            out.output = name + "\n";
+        } else if (binary) {
+            out.output = "Binary file " + name + " matches\n";
+        }
+    }
+
+private:
+    size_t find_literal(std::string_view text, size_t from) const {
+        if (!options_.ignoreCase) {
+#ifndef _WIN32
+            const void* found = memmem(text.data() + from, text.size() - from, literal_.data(), literal_.size());
+            return found ? static_cast<size_t>(static_cast<const char*>(found) - text.data()) : std::string_view::npos;
+#else
+            return text.find(literal_, from);
+#endif
+        }
+        // Look for either case of the first byte, then compare the rest
+        char lower = literal_[0];
+        char upper = static_cast<char>(std::toupper(static_cast<unsigned char>(lower)));
+        size_t nextLower = text.find(lower, from);
+        size_t nextUpper = lower == upper ? std::string_view::npos : text.find(upper, from);
+        for (;;) {
+            size_t at = std::min(nextLower, nextUpper);
+            if (at == std::string_view::npos || text.size() - at < literal_.size()) return std::string_view::npos;
+            size_t i = 1;
+            while (i < literal_.size() && std::tolower(static_cast<unsigned char>(text[at + i])) == literal_[i]) i++;
+            if (i == literal_.size()) return at;
+            if (at == nextLower) nextLower = text.find(lower, at + 1);
+            else nextUpper = text.find(upper, at + 1);
+        }
+    }
+
+    const GrepOptions &options_;
+    std::string literal_;
+    bool literalOnly_;
+    std::regex regex_;
+};
+
+void grep_file(const GrepMatcher &matcher, const std::string &path, GrepResult &result) try {
+    std::error_code error;
+    fs::file_status status = fs::status(path, error);
+    if (!error && !fs::is_regular_file(status)) {
+        result.error = "grep: " + path + (fs::is_directory(status) ? ": Is a directory" : ": Not a regular file");
+        return;
+    }
+#ifndef _WIN32
+    if (std::shared_ptr<MappedFile> mapped = map_file(path)) {
+        matcher.search(mapped->view(), path, result);
+        return;
+    }
+#endif
+    // Too small to be worth mapping
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        result.error = "Cannot read " + path;
+        return;
+    }
+    std::string content(static_cast<size_t>(std::max<std::streamoff>(file.tellg(), 0)), '\0');
+    file.seekg(0);
+    file.read(&content[0], static_cast<std::streamsize>(content.size()));
+    content.resize(static_cast<size_t>(file.gcount()));
+    matcher.search(content, path, result);
+} catch (const std::exception &e) {
+    // e.g. std::regex giving up on lines that are too complex for it. Files
+    // are searched on the pool, so nothing may escape to the task.
+    result = GrepResult();
+    result.error = "Cannot search " + path + ": " + e.what();
+}
+
+// Expand directories for -r, skipping symbolic links like grep does
+void grep_paths(const std::string &path, std::vector<std::string> &files) {
+#ifndef _WIN32
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        files.push_back(path);
+        return;
+    }
+    DirectoryListing listing;
+    ListOptions options;
+    options.all = true;
+    bool listed = read_entries(fd, options, listing);
+    for (ListEntry &entry : listing.entries) {
+        if (entry.type == EntryType::Unknown) stat_entry(fd, listing.names.data() + entry.nameOffset, entry);
+    }
+    close(fd);
+    if (!listed) return;
+    sort_listing(listing, options);
+    for (const ListEntry &entry : listing.entries) {
+        std::string child = join_path(path, listing.name(entry));
+        if (entry.type == EntryType::Dir) grep_paths(child, files);
+        else if (entry.type == EntryType::File) files.push_back(std::move(child));
+    }
+#else
+    std::error_code error;
+    if (!fs::is_directory(path, error)) {
+        files.push_back(path);
+        return;
+    }
+    std::vector<std::string> found;
+    for (const auto &entry : fs::recursive_directory_iterator(path, error)) {
+        if (entry.is_regular_file(error)) found.push_back(entry.path().string());
+    }
+    std::sort(found.begin(), found.end());
+    files.insert(files.end(), found.begin(), found.end());
+#endif
+}
+
+// Variable Assignment and Expansion
+// Expansion is a single left-to-right pass that appends to `out`. Substituted
+// text is never scanned again, so values containing `$` are inserted as-is
+// and the cost is linear in the size of the result.
+//   $name  ${name}  ${name:-default}  $#  $(command)
+std::string capture_command_output(const std::string &command);
+
+// Index of the bracket closing the one at `open`, skipping quoted text
+size_t find_closing(const std::string &input, size_t open, char opening, char closing) {
+    int depth = 0;
+    char quote = 0;
+    for (size_t i = open; i < input.length(); i++) {
+        char c = input[i];
+        if (quote) {
+            if (c == quote) quote = 0;
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+        } else if (c == opening) {
+            depth++;
+        } else if (c == closing && --depth == 0) {
+            return i;
+        }
+    }
+    return std::string::npos;
+}
+
+bool is_name_char(char c) {
+    return isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+// Tracks whether expansion is inside quotes so that substituted values can
+// be escaped for the lexer: a value is one or more words, never an operator
+// or a quote.
+struct QuoteState {
+    char quote = 0;
+
+    void scan(const std::string &input, size_t from, size_t to) {
+        for (size_t i = from; i < to; i++) {
+            char c = input[i];
+            if (quote == '\'') {
+                if (c == '\'') quote = 0;
+            } else if (c == '\\') {
+                i++;
+            } else if (c == '"') {
+                quote = quote ? 0 : '"';
+            } else if (c == '\'' && !quote && input.find('\'', i + 1) != std::string::npos) {
+                quote = '\'';
+            }
+        }
+    }
+
+    void append(std::string &out, std::string_view value) const {
+        for (char c : value) {
+            if (quote == '"' ? (c == '"' || c == '\\') : (!quote && !is_blank(c) && is_escapable(c))) out += '\\';
+            out += c;
+        }
+    }
+};
+
+// With `quoted` set, values are escaped for lex_line (see QuoteState)
+void expand_variables_into(const std::string &input, std::string &out, bool quoted = false) {
+    QuoteState state;
+    auto append_value = [&](std::string_view value) {
+        if (quoted) state.append(out, value);
+        else out += value;
+    };
+
+    size_t pos = 0;
+    while (pos < input.length()) {
+        size_t dollar = input.find('$', pos);
+        if (dollar == std::string::npos) {
+            out.append(input, pos, std::string::npos);
+            break;
+        }
+        out.append(input, pos, dollar - pos);
+        if (quoted) state.scan(input, pos, dollar);
+        pos = dollar + 1;
+        char c = pos < input.length() ? input[pos] : '\0';
+
+        if (c == '(') {
+            size_t close = find_closing(input, pos, '(', ')');
+            if (close == std::string::npos) {
+                out += '$'; // unterminated, keep literally
+                continue;
+            }
+            append_value(capture_command_output(input.substr(pos + 1, close - pos - 1)));
+            pos = close + 1;
+        } else if (c == '{') {
+            size_t close = find_closing(input, pos, '{', '}');
+            if (close == std::string::npos) {
+                out += '$';
+                continue;
+            }
+            size_t defaultPos = input.find(":-", pos);
+            bool hasDefault = defaultPos < close;
+            std::string name = input.substr(pos + 1, (hasDefault ? defaultPos : close) - pos - 1);
+            const Value* value = find_variable(name);
+            if (value && (!value->empty() || !hasDefault)) {
+                append_value(value->view());
+            } else if (hasDefault) {
+                expand_variables_into(input.substr(defaultPos + 2, close - defaultPos - 2), out, quoted);
+            }
+            pos = close + 1;
+        } else if (c == '#' || is_name_char(c)) {
+            size_t end = pos + 1; // `#` is the argument count inside functions
+            if (c != '#') {
+                while (end < input.length() && is_name_char(input[end])) end++;
+            }
+            // Variable not found expands to an empty string
+            if (const Value* value = find_variable(input.substr(pos, end - pos))) {
+                append_value(value->view());
+            }
+            pos = end;
+        } else {
+            // Lone $ character
+            out += '$';
+        }
+    }
+}
+
+std::string expand_variables(const std::string &input) {
+    std::string result;
+    result.reserve(input.length());
+    expand_variables_into(input, result);
+    return result;
+}
+
+// Reusable per-command buffers, one set per nesting level, because function
+// calls and $(...) re-enter the interpreter while an outer command is still
+// using its buffers. A deque keeps references stable as levels are added.
+struct CommandScratch {
+    std::string expanded;
+    LexedLine lexed;
+    LexedLine literal; // words of a literalArgs builtin
+    Args args;
+};
+
+std::deque<CommandScratch> command_scratch;
+size_t command_depth = 0;
+
+struct ScratchGuard {
+    CommandScratch &scratch;
+
+    ScratchGuard() : scratch(acquire()) {}
+    ~ScratchGuard() {
+        // Don't keep a huge buffer around after expanding a large file
+        if (scratch.expanded.capacity() > (1u << 20)) scratch = CommandScratch();
+        command_depth--;
+    }
+
+    static CommandScratch &acquire() {
+        if (command_depth == command_scratch.size()) command_scratch.emplace_back();
+        return command_scratch[command_depth++];
+    }
+};
+
+// Expression Engine
+//
+// `calc` expressions are parsed once by a Pratt parser into a flat RPN
+// program that is cached by its text, so a `calc` inside a loop only runs the
+// program again. Bare names read variables when the program runs, which keeps
+// the text (and so the cache entry) the same on every iteration. Integers stay
+// exact 64-bit values until an operation needs a fraction or overflows.
+struct CalcValue {
+    bool isInt = true;
+    int64_t i = 0;
+    double d = 0;
+
+    static CalcValue integer(int64_t value) { CalcValue v; v.i = value; return v; }
+    static CalcValue real(double value) { CalcValue v; v.isInt = false; v.d = value; return v; }
+    double number() const { return isInt ? static_cast<double>(i) : d; }
+};
+
+struct MathFunction {
+    std::string_view name;
+    double (*apply)(double);
+    bool integral; // result is a whole number
+};
+
+constexpr MathFunction math_functions[] = {
+    {"sin", [](double x) { return std::sin(x); }, false},
+    {"cos", [](double x) { return std::cos(x); }, false},
+    {"tan", [](double x) { return std::tan(x); }, false},
+    {"log", [](double x) { return std::log(x); }, false},
+    {"exp", [](double x) { return std::exp(x); }, false},
+    {"sqrt", [](double x) { return std::sqrt(x); }, false},
+    {"abs", [](double x) { return std::fabs(x); }, false},
+    {"round", [](double x) { return std::round(x); }, true},
+    {"floor", [](double x) { return std::floor(x); }, true},
+    {"ceil", [](double x) { return std::ceil(x); }, true},
+};
+
+enum class ExprOp : uint8_t {
+    Push, Load, Call, // arg: constant, name or function index
+    Negate, BitNot,
+    Add, Sub, Mul, Div, Mod, Pow, BitAnd, BitOr, BitXor, Shl, Shr,
+};
+
+struct ExprInstr {
+    ExprOp op;
+    uint32_t arg;
+};
+
+struct CompiledExpr {
+    std::vector<ExprInstr> code;
+    std::vector<CalcValue> constants;
+    std::vector<std::string> names;
+    size_t maxDepth = 0;
+};
+
+struct BinaryOperator {
+    std::string_view symbol;
+    int precedence;
+    bool rightAssoc;
+    ExprOp op;
+};
+
+// Longer symbols first so `**` and `<<` are not read as `*` and `<`
+constexpr BinaryOperator binary_operators[] = {
+    {"**", 8, true, ExprOp::Pow},
+    {"<<", 4, false, ExprOp::Shl},
+    {">>", 4, false, ExprOp::Shr},
+    {"*", 6, false, ExprOp::Mul},
+    {"/", 6, false, ExprOp::Div},
+    {"%", 6, false, ExprOp::Mod},
+    {"+", 5, false, ExprOp::Add},
+    {"-", 5, false, ExprOp::Sub},
+    {"&", 3, false, ExprOp::BitAnd},
+    {"^", 2, false, ExprOp::BitXor},
+    {"|", 1, false, ExprOp::BitOr},
+};
+
+constexpr int kUnaryPrecedence = 7; // binds looser than `**`: -2**2 is -4
+
+class ExprParser {
+public:
+    ExprParser(std::string_view text, CompiledExpr &out) : text_(text), out_(out) {}
+
+    bool parse() {
+        out_ = CompiledExpr();
+        if (!expression(1)) return false;
+        skip_blanks();
+        if (pos_ < text_.size()) return fail("Unexpected '" + std::string(text_.substr(pos_, 1)) + "'");
+        return true;
+    }
+
+    const std::string &error() const { return error_; }
+
+private:
+    bool expression(int minPrecedence) {
+        if (!prefix()) return false;
+        for (;;) {
+            skip_blanks();
+            const BinaryOperator* binary = nullptr;
+            for (const BinaryOperator &candidate : binary_operators) {
+                if (text_.compare(pos_, candidate.symbol.size(), candidate.symbol) == 0) {
+                    binary = &candidate;
+                    break;
+                }
+            }
+            if (!binary || binary->precedence < minPrecedence) return true;
+            pos_ += binary->symbol.size();
+            if (!expression(binary->rightAssoc ? binary->precedence : binary->precedence + 1)) return false;
+            emit(binary->op, 0, -1);
+        }
+    }
+
+    bool prefix() {
+        skip_blanks();
+        if (pos_ == text_.size()) return fail("Expression ends too early");
+        char c = text_[pos_];
+        if (c == '-' || c == '+' || c == '~') {
+            pos_++;
+            if (!expression(kUnaryPrecedence)) return false;
+            if (c == '-') emit(ExprOp::Negate, 0, 0);
+            if (c == '~') emit(ExprOp::BitNot, 0, 0);
+            return true;
+        }
+        if (c == '(') {
+            pos_++;
+            if (!expression(1)) return false;
+            return expect(')');
+        }
+        if (std::isdigit(static_cast<unsigned char>(c)) || c == '.') return number();
+        if (std::isalpha(static_cast<unsigned char>(c)) || c == '_') return name();
+        return fail("Unexpected '" + std::string(1, c) + "'");
+    }
+
+    bool number() {
+        constexpr std::string_view delimiters = " \t+-*/%()&|^~<>,";
+        bool hex = text_.compare(pos_, 2, "0x") == 0 || text_.compare(pos_, 2, "0X") == 0;
+        size_t stop = text_.find_first_of(delimiters, pos_);
+        // An exponent's sign belongs to the literal: 1e-3
+        while (!hex && stop != std::string_view::npos && (text_[stop] == '+' || text_[stop] == '-') &&
+               (text_[stop - 1] == 'e' || text_[stop - 1] == 'E')) {
+            stop = text_.find_first_of(delimiters, stop + 1);
+        }
+        std::string literal(text_.substr(pos_, stop == std::string_view::npos ? stop : stop - pos_));
+        pos_ += literal.size();
+
+        char* end = nullptr;
+        errno = 0;
+        if (hex || literal.find_first_of(".eE") == std::string::npos) {
+            long long value = std::strtoll(literal.c_str(), &end, hex ? 16 : 10);
+            if (*end == '\0' && errno == 0) return push(CalcValue::integer(value));
+            if (hex || *end != '\0') return fail("Invalid number '" + literal + "'");
+        }
+        double value = std::strtod(literal.c_str(), &end);
+        if (*end != '\0') return fail("Invalid number '" + literal + "'");
+        return push(CalcValue::real(value));
+    }
+
+    bool name() {
+        size_t start = pos_;
+        while (pos_ < text_.size() && (std::isalnum(static_cast<unsigned char>(text_[pos_])) || text_[pos_] == '_')) pos_++;
+        std::string_view word = text_.substr(start, pos_ - start);
+        skip_blanks();
+        if (pos_ == text_.size() || text_[pos_] != '(') {
+            auto known = std::find(out_.names.begin(), out_.names.end(), word);
+            uint32_t index = static_cast<uint32_t>(known - out_.names.begin());
+            if (known == out_.names.end()) out_.names.emplace_back(word);
+            emit(ExprOp::Load, index, 1);
+            return true;
+        }
+
+        const MathFunction* function = nullptr;
+        for (const MathFunction &candidate : math_functions) {
+            if (candidate.name == word) function = &candidate;
+        }
+        if (!function) return fail("Unknown function: " + std::string(word));
+        pos_++;
+        if (!expression(1)) return false;
+        skip_blanks();
+        if (pos_ < text_.size() && text_[pos_] == ',') return fail(std::string(word) + " takes one argument");
+        if (!expect(')')) return false;
+        emit(ExprOp::Call, static_cast<uint32_t>(function - math_functions), 0);
+        return true;
+    }
+
+    bool push(CalcValue value) {
+        out_.constants.push_back(value);
+        emit(ExprOp::Push, static_cast<uint32_t>(out_.constants.size() - 1), 1);
+        return true;
+    }
+
+    void emit(ExprOp op, uint32_t arg, int stackEffect) {
+        out_.code.push_back({op, arg});
+        depth_ += stackEffect;
+        out_.maxDepth = std::max(out_.maxDepth, depth_);
+    }
+
+    bool expect(char c) {
+        skip_blanks();
+        if (pos_ < text_.size() && text_[pos_] == c) {
+            pos_++;
+            return true;
+        }
+        return fail(std::string("Expected '") + c + "'");
+    }
+
+    void skip_blanks() {
+        while (pos_ < text_.size() && is_blank(text_[pos_])) pos_++;
+    }
+
+    bool fail(const std::string &message) {
+        error_ = message;
+        return false;
+    }
+
+    std::string_view text_;
+    CompiledExpr &out_;
+    size_t pos_ = 0;
+    size_t depth_ = 0;
+    std::string error_;
+};
+
+// Compiled expressions by text; nodes are stable, so pointers stay valid
+// until the cache is cleared to make room
+constexpr size_t kExprCacheSize = 256;
+std::unordered_map<std::string, CompiledExpr> expr_cache;
+
+const CompiledExpr* compile_expression(const std::string &text) {
+    auto cached = expr_cache.find(text);
+    if (cached != expr_cache.end()) return &cached->second;
+
+    CompiledExpr compiled;
+    ExprParser parser(text, compiled);
+    if (!parser.parse()) {
+        show_error(parser.error() + " in expression: " + text);
+        return nullptr;
+    }
+    if (expr_cache.size() >= kExprCacheSize) expr_cache.clear();
+    return &expr_cache.emplace(text, std::move(compiled)).first->second;
+}
+
+bool load_number(const std::string &name, CalcValue &out) {
+    const Value* value = find_variable(name);
+    if (!value) {
+        show_error("Unknown variable: " + name);
+        return false;
+    }
+    std::string text = value->str();
+    char* end = nullptr;
+    errno = 0;
+    long long integer = std::strtoll(text.c_str(), &end, 10);
+    while (is_blank(*end)) end++;
+    if (end != text.c_str() && *end == '\0' && errno == 0) {
+        out = CalcValue::integer(integer);
+        return true;
+    }
+    double real = std::strtod(text.c_str(), &end);
+    while (is_blank(*end)) end++;
+    if (end == text.c_str() || *end != '\0') {
+        show_error("Variable " + name + " is not a number: " + text);
+        return false;
+    }
+    out = CalcValue::real(real);
+    return true;
+}
+
+// Bitwise operators accept doubles holding whole numbers
+bool to_integer(const CalcValue &value, int64_t &out) {
+    if (value.isInt) {
+        out = value.i;
+        return true;
+    }
+    if (value.d != std::trunc(value.d) || std::fabs(value.d) >= 9.2e18) {
+        show_error("Bitwise operators need whole numbers");
+        return false;
+    }
+    out = static_cast<int64_t>(value.d);
+    return true;
+}
+
+// 64-bit arithmetic that reports overflow instead of wrapping
+bool checked_add(int64_t a, int64_t b, int64_t &out) {
+    if ((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b)) return false;
+    out = a + b;
+    return true;
+}
+
+bool checked_mul(int64_t a, int64_t b, int64_t &out) {
+    if (a == 0 || b == 0) {
+        out = 0;
+        return true;
+    }
+    if ((a == -1 && b == INT64_MIN) || (b == -1 && a == INT64_MIN)) return false;
+    if (a > 0 ? (b > 0 ? a > INT64_MAX / b : b < INT64_MIN / a)
+              : (b > 0 ? a < INT64_MIN / b : a < INT64_MAX / b)) return false;
+    out = a * b;
+    return true;
+}
+
+bool apply_binary(ExprOp op, const CalcValue &a, const CalcValue &b, CalcValue &out) {
+    bool ints = a.isInt && b.isInt;
+    int64_t result;
+    switch (op) {
+    case ExprOp::Add:
+        out = ints && checked_add(a.i, b.i, result) ? CalcValue::integer(result) : CalcValue::real(a.number() + b.number());
+        return true;
+    case ExprOp::Sub:
+        out = ints && b.i != INT64_MIN && checked_add(a.i, -b.i, result) ? CalcValue::integer(result)
+                                                                         : CalcValue::real(a.number() - b.number());
+        return true;
+    case ExprOp::Mul:
+        out = ints && checked_mul(a.i, b.i, result) ? CalcValue::integer(result) : CalcValue::real(a.number() * b.number());
+        return true;
+    case ExprOp::Div:
+    case ExprOp::Mod:
+        if (b.number() == 0) {
+            show_error("Division by zero");
+            return false;
+        }
+        if (op == ExprOp::Mod) {
+            out = ints ? CalcValue::integer(b.i == -1 ? 0 : a.i % b.i) : CalcValue::real(std::fmod(a.number(), b.number()));
+        } else {
+            // Integer division stays exact when there is no remainder
+            bool exact = ints && !(a.i == INT64_MIN && b.i == -1) && a.i % b.i == 0;
+            out = exact ? CalcValue::integer(a.i / b.i) : CalcValue::real(a.number() / b.number());
+        }
+        return true;
+    case ExprOp::Pow:
+        if (ints && b.i >= 0) {
+            int64_t base = a.i, exponent = b.i;
+            result = 1;
+            bool fits = true;
+            while (exponent > 0 && fits) {
+                if (exponent & 1) fits = checked_mul(result, base, result);
+                exponent >>= 1;
+                if (exponent > 0 && fits) fits = checked_mul(base, base, base);
+            }
+            if (fits) {
+                out = CalcValue::integer(result);
+                return true;
+            }
+        }
+        out = CalcValue::real(std::pow(a.number(), b.number()));
+        return true;
+    default:
+        break;
+    }
+
+    int64_t x, y;
+    if (!to_integer(a, x) || !to_integer(b, y)) return false;
+    if ((op == ExprOp::Shl || op == ExprOp::Shr) && (y < 0 || y > 63)) {
+        show_error("Shift count out of range: " + std::to_string(y));
+        return false;
+    }
+    switch (op) {
+    case ExprOp::BitAnd: out = CalcValue::integer(x & y); break;
+    case ExprOp::BitOr: out = CalcValue::integer(x | y); break;
+    case ExprOp::BitXor: out = CalcValue::integer(x ^ y); break;
+    case ExprOp::Shl: out = CalcValue::integer(static_cast<int64_t>(static_cast<uint64_t>(x) << y)); break;
+    default: out = CalcValue::integer(x >> y); break;
+    }
+    return true;
+}
+
+// Operand stack reused between evaluations
+std::vector<CalcValue> expr_stack;
+
+bool evaluate_expression(const CompiledExpr &expr, CalcValue &result) {
+    std::vector<CalcValue> &stack = expr_stack;
+    stack.clear();
+    stack.reserve(expr.maxDepth);
+    for (const ExprInstr &instr : expr.code) {
+        switch (instr.op) {
+        case ExprOp::Push:
+            stack.push_back(expr.constants[instr.arg]);
+            break;
+        case ExprOp::Load:
+            stack.emplace_back();
+            if (!load_number(expr.names[instr.arg], stack.back())) return false;
+            break;
+        case ExprOp::Call: {
+            const MathFunction &function = math_functions[instr.arg];
+            double value = function.apply(stack.back().number());
+            bool whole = function.integral && std::fabs(value) < 9.2e18;
+            stack.back() = whole ? CalcValue::integer(static_cast<int64_t>(value)) : CalcValue::real(value);
+            break;
+        }
+        case ExprOp::Negate: {
+            CalcValue &top = stack.back();
+            top = top.isInt && top.i != INT64_MIN ? CalcValue::integer(-top.i) : CalcValue::real(-top.number());
+            break;
+        }
+        case ExprOp::BitNot: {
+            int64_t value;
+            if (!to_integer(stack.back(), value)) return false;
+            stack.back() = CalcValue::integer(~value);
+            break;
+        }
+        default: {
+            CalcValue right = stack.back();
+            stack.pop_back();
+            if (!apply_binary(instr.op, stack.back(), right, stack.back())) return false;
+            break;
+        }
+        }
+    }
+    result = stack.back();
+    return true;
+}
+
+bool calculate(const std::string &expression, CalcValue &result) {
+    const CompiledExpr* compiled = compile_expression(expression);
+    return compiled && evaluate_expression(*compiled, result);
+}
+
+std::string format_number(const CalcValue &value) {
+    if (value.isInt) return std::to_string(value.i);
+    std::ostringstream formatted;
+    formatted << std::setprecision(15) << value.d;
+    return formatted.str();
+}
+
+// Ctrl-C while an AI request runs cancels the request instead of killing
+// the shell; curl notices the flag in its progress callback.
+volatile std::sig_atomic_t ai_interrupted = 0;
+
+extern "C" void on_ai_interrupt(int) {
+    ai_interrupted = 1;
+}
+
+struct InterruptGuard {
+    void (*previous)(int);
+
+    InterruptGuard() : previous(std::signal(SIGINT, on_ai_interrupt)) { ai_interrupted = 0; }
+    ~InterruptGuard() { std::signal(SIGINT, previous); }
+};
+
+int abort_on_interrupt(void*, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+    return ai_interrupted ? 1 : 0;
+}
+
+// Incremental parser for server-sent events. Bytes are fed in as they
+// arrive and the payload of every complete event (its `data:` lines) is
+// handed to `onEvent`. Anything that is not an event stream, such as a JSON
+// error body, is kept in raw() for the caller.
+class SseParser {
+public:
+    explicit SseParser(std::function<void(std::string_view)> onEvent) : onEvent_(std::move(onEvent)) {}
+
+    void feed(const char *data, size_t size) {
+        if (!sawEvent_ && raw_.size() < kRawLimit) raw_.append(data, std::min(size, kRawLimit - raw_.size()));
+        pending_.append(data, size);
+
+        size_t start = 0;
+        for (size_t end; (end = pending_.find('\n', start)) != std::string::npos; start = end + 1) {
+            std::string_view line(pending_.data() + start, end - start);
+            if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+            handle_line(line);
+        }
+        pending_.erase(0, start);
+    }
+
+    // Dispatch an event left unterminated when the stream ended
+    void finish() {
+        if (!pending_.empty()) handle_line(pending_);
+        handle_line("");
+    }
+
+    bool sawEvent() const { return sawEvent_; }
+    const std::string &raw() const { return raw_; }
+
+private:
+    static constexpr size_t kRawLimit = 64 * 1024;
+
+    void handle_line(std::string_view line) {
+        if (line.empty()) {
+            if (hasData_) {
+                sawEvent_ = true;
+                onEvent_(data_);
+                data_.clear();
+                hasData_ = false;
+            }
+        } else if (line.substr(0, 5) == "data:") {
+            line.remove_prefix(5);
+            if (!line.empty() && line[0] == ' ') line.remove_prefix(1);
+            if (hasData_) data_ += '\n';
+            data_.append(line);
+            hasData_ = true;
+        }
+        // Comments (`:`) and the event/id/retry fields are not used
+    }
+
+    std::function<void(std::string_view)> onEvent_;
+    std::string pending_;
+    std::string data_;
+    std::string raw_;
+    bool hasData_ = false;
+    bool sawEvent_ = false;
+};
+
+size_t SseWriteCallback(char *contents, size_t size, size_t nmemb, void *parser) {
+    static_cast<SseParser*>(parser)->feed(contents, size * nmemb);
+    return size * nmemb;
+}
+
+// AI Backends
+// Every AI request goes through the backend selected with AI_BACKEND:
+//   http  (default) an OpenAI-compatible server at AI_BASE_URL: Groq, or a
+//         local llama.cpp or Ollama server, e.g. http://localhost:11434/v1
+//   stub  in-process answers for tests, with no network at all
+class AiBackend {
+public:
+    virtual ~AiBackend() = default;
+
+    // POST a JSON body to the endpoint `path` (e.g. "chat/completions"). The
+    // response body is passed to `write` as it arrives, exactly as an
+    // OpenAI-compatible server sends it, and the HTTP status is stored in
+    // `httpCode` (0 if no response arrived). Ctrl-C aborts the request with
+    // CURLE_ABORTED_BY_CALLBACK.
+    virtual CURLcode post(const std::string &path, const std::string &body, curl_write_callback write,
+                          void *userdata, long &httpCode) = 0;
+
+    // Distinguishes backends in the response cache
+    virtual std::string id() const = 0;
+};
+
+const char* kDefaultBaseUrl = "https://api.groq.com/openai/v1";
+
+// Groq needs an API key; the stub and local servers do not
+bool ai_key_required() {
+    return variable_or("AI_BACKEND", "http") != "stub" && variable_or("AI_BASE_URL", kDefaultBaseUrl) == kDefaultBaseUrl;
+}
+
+// HTTP Backend
+// One backend lives for the whole session. Its curl handle is reused for
+// every request, so the connection to the API (TCP, TLS and, where the
+// server supports it, HTTP/2) stays open between AI commands. DNS results,
+// TLS sessions and connections are kept in a share handle that later
+// handles can join. The header list is built once per API key.
+//
+// AI_BASE_URL points the backend at another OpenAI-compatible server, e.g. a
+// local one: set AI_BASE_URL http://localhost:8080/v1
+class HttpBackend : public AiBackend {
+public:
+    HttpBackend() {
+        curl_global_init(CURL_GLOBAL_ALL);
+        share_ = curl_share_init();
+        if (share_) {
+            curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+            curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+            curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+        }
+        easy_ = curl_easy_init();
+    }
+
+    ~HttpBackend() override {
+        if (easy_) curl_easy_cleanup(easy_);
+        if (multi_) curl_multi_cleanup(multi_);
+        if (share_) curl_share_cleanup(share_);
+        if (headers_) curl_slist_free_all(headers_);
+        curl_global_cleanup();
+    }
+
+    HttpBackend(const HttpBackend&) = delete;
+    HttpBackend& operator=(const HttpBackend&) = delete;
+
+    CURLcode post(const std::string &path, const std::string &body, curl_write_callback write, void *userdata,
+                  long &httpCode) override {
+        httpCode = 0;
+        if (!easy_) return CURLE_FAILED_INIT;
+
+        url_ = url(path);
+        configure(easy_);
+        curl_easy_setopt(easy_, CURLOPT_URL, url_.c_str());
+        curl_easy_setopt(easy_, CURLOPT_POSTFIELDS, body.c_str());
+        curl_easy_setopt(easy_, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(body.size()));
+        curl_easy_setopt(easy_, CURLOPT_WRITEFUNCTION, write);
+        curl_easy_setopt(easy_, CURLOPT_WRITEDATA, userdata);
+
+        InterruptGuard interrupt;
+        CURLcode res = curl_easy_perform(easy_);
+        curl_easy_getinfo(easy_, CURLINFO_RESPONSE_CODE, &httpCode);
+        return res;
+    }
+
+    std::string id() const override {
+        return url("");
+    }
+
+    // Full URL of an API endpoint
+    std::string url(const std::string &path) const {
+        std::string base = variable_or("AI_BASE_URL", kDefaultBaseUrl);
+        while (!base.empty() && base.back() == '/') base.pop_back();
+        return base + "/" + path;
+    }
+
+    // Multi handle for running several requests at once; its handles share
+    // connections with the single-request handle
+    CURLM *multi() {
+        if (!multi_) multi_ = curl_multi_init();
+        return multi_;
+    }
+
+    // Options every handle talking to the API needs
+    void configure(CURL *handle) {
+        if (headersKey_ != groq_api_key || !headers_) {
+            if (headers_) curl_slist_free_all(headers_);
+            headers_ = build_headers();
+            headersKey_ = groq_api_key;
+        }
+
+        if (share_) curl_easy_setopt(handle, CURLOPT_SHARE, share_);
+        curl_easy_setopt(handle, CURLOPT_HTTPHEADER, headers_);
+        curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, static_cast<long>(CURL_HTTP_VERSION_2TLS));
+        curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L); // prefer multiplexing over new connections
+        curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(handle, CURLOPT_ACCEPT_ENCODING, "");
+        curl_easy_setopt(handle, CURLOPT_DNS_CACHE_TIMEOUT, 600L);
+        curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, 0L);
+        curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+
+        // Long generations may take minutes, so instead of a total timeout
+        // give up on connections that cannot be made or go silent
+        curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, 15L);
+        curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, 60L);
+        curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0L);
+        curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, abort_on_interrupt);
+    }
+
+    // A new header list for the current API key; the caller frees it
+    static curl_slist *build_headers() {
+        curl_slist *headers = curl_slist_append(nullptr, "Content-Type: application/json");
+        if (!groq_api_key.empty()) {
+            headers = curl_slist_append(headers, ("Authorization: Bearer " + groq_api_key).c_str());
+        }
+        return curl_slist_append(headers, "Expect:"); // no 100-continue round trip
+    }
+
+private:
+    CURL *easy_ = nullptr;
+    CURLM *multi_ = nullptr;
+    CURLSH *share_ = nullptr;
+    curl_slist *headers_ = nullptr;
+    std::string headersKey_;
+    std::string url_;
+};
+
+// Created on first use, after the shell's variables are set up
+HttpBackend &http_backend() {
+    static HttpBackend backend;
+    return backend;
+}
+
+// Stub Backend
+// Answers every chat completion by echoing the last user message, in the
+// same wire format as the HTTP API: a JSON body, or an event stream when the
+// request asks for one. Response parsing and streaming therefore run exactly
+// as they would against a server. A message containing AI_STUB_ERROR gets an
+// error response.
+class StubBackend : public AiBackend {
+public:
+    CURLcode post(const std::string &path, const std::string &body, curl_write_callback write, void *userdata,
+                  long &httpCode) override {
+        json request = json::parse(body, nullptr, false);
+        std::string prompt;
+        if (!request.is_discarded() && request.contains("messages") && !request["messages"].empty()) {
+            prompt = request["messages"].back().value("content", "");
+        }
+
+        if (path != "chat/completions") {
+            httpCode = 404;
+            return send(json{{"error", {{"message", "Unknown endpoint: " + path}}}}.dump(), write, userdata);
+        }
+        if (request.is_discarded() || prompt.find("AI_STUB_ERROR") != std::string::npos) {
+            httpCode = 400;
+            return send(json{{"error", {{"message", "Stub backend error"}}}}.dump(), write, userdata);
+        }
+
+        httpCode = 200;
+        std::string answer = "stub: " + prompt;
+        if (!request.value("stream", false)) {
+            json response = {{"choices", json::array({{{"message", {{"role", "assistant"}, {"content", answer}}}}})}};
+            return send(response.dump(), write, userdata);
+        }
+
+        // One event per word, like a model generating tokens
+        for (size_t start = 0; start < answer.size();) {
+            size_t end = answer.find(' ', start + 1);
+            if (end == std::string::npos) end = answer.size();
+            json chunk = {{"choices", json::array({{{"delta", {{"content", answer.substr(start, end - start)}}}}})}};
+            CURLcode res = send("data: " + chunk.dump() + "\n\n", write, userdata);
+            if (res != CURLE_OK) return res;
+            start = end;
+        }
+        return send("data: [DONE]\n\n", write, userdata);
+    }
+
+    std::string id() const override {
+        return "stub";
+    }
+
+private:
+    static CURLcode send(std::string data, curl_write_callback write, void *userdata) {
+        if (ai_interrupted) return CURLE_ABORTED_BY_CALLBACK;
+        return write(data.data(), 1, data.size(), userdata) == data.size() ? CURLE_OK : CURLE_WRITE_ERROR;
+    }
+};
+
+AiBackend &ai_backend() {
+    static StubBackend stub;
+    if (variable_or("AI_BACKEND", "http") == "stub") return stub;
+    return http_backend();
+}
+
+// Show an error and return false if the backend needs an API key that is not set
+bool ai_key_ready() {
+    if (!groq_api_key.empty() || !ai_key_required()) return true;
+    show_error("Groq API key not set. Use 'set GROQ_API_KEY your_api_key' to enable AI features.");
+    return false;
+}
+
+// Initialize Groq API
+bool init_groq_api() {
+    // Check if API key is set
+    if (variables.find("GROQ_API_KEY") != variables.end()) {
+        groq_api_key = variables["GROQ_API_KEY"].str();
+        std::cout << "\033[1;32mGroq AI API enabled\033[0m" << std::endl;
+        return true;
+    }
+    
+    std::cout << "\033[1;33mGroq AI API not configured. Use 'set GROQ_API_KEY your_api_key' to enable AI features.\033[0m" << std::endl;
+    return false;
+}
+
+// Directory for the shell's own state: $HOME/.myshell
+fs::path myshell_dir() {
+    const char *home = getenv("HOME");
+    if (!home) home = getenv("USERPROFILE");
+    return fs::path(variable_or("HOME", home ? home : ".")) / ".myshell";
+}
+
+// SHA-256 (FIPS 180-4) of `data` into `digest`
+void sha256(std::string_view data, unsigned char digest[32]) {
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    auto rotr = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+    auto compress = [&](const unsigned char* block) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = uint32_t(block[4 * i]) << 24 | uint32_t(block[4 * i + 1]) << 16 | uint32_t(block[4 * i + 2]) << 8 | block[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    };
+
+    size_t whole = data.size() / 64 * 64;
+    for (size_t i = 0; i < whole; i += 64) compress(reinterpret_cast<const unsigned char*>(data.data()) + i);
+    // Padding: 0x80, zeros, then the length in bits, big-endian
+    unsigned char tail[128] = {};
+    size_t rest = data.size() - whole;
+    std::memcpy(tail, data.data() + whole, rest);
+    tail[rest] = 0x80;
+    size_t tailSize = rest < 56 ? 64 : 128;
+    uint64_t bits = static_cast<uint64_t>(data.size()) * 8;
+    for (int i = 0; i < 8; i++) tail[tailSize - 1 - i] = static_cast<unsigned char>(bits >> (8 * i));
+    for (size_t i = 0; i < tailSize; i += 64) compress(tail + i);
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 4; j++) digest[4 * i + j] = static_cast<unsigned char>(h[i] >> (24 - 8 * j));
+    }
+}
+
+// AI Response Cache
+// Successful answers are stored on disk, addressed by a 128-bit hash (the
+// first half of a SHA-256 digest) of everything that went into the request (model, system prompt, prompt with
+// any file contents, sampling settings). One file per answer, named by the
+// hash, holding a header line and the answer text. The least recently used
+// answers are evicted once the cache grows past AI_CACHE_SIZE bytes.
+//   AI_CACHE      set to "off" to bypass the cache
+//   AI_CACHE_DIR  defaults to $HOME/.myshell/aicache
+//   AI_CACHE_SIZE defaults to 64 MiB
+class AiCache {
+public:
+    struct Stats {
+        size_t entries;
+        std::uintmax_t bytes;
+        std::uintmax_t limit;
+        uint64_t hits;
+        uint64_t misses;
+    };
+
+    static std::string key(std::string_view material) {
+        unsigned char digest[32];
+        sha256(material, digest);
+        static const char digits[] = "0123456789abcdef";
+        std::string hex(32, '0');
+        for (int i = 0; i < 16; i++) {
+            hex[2 * i] = digits[digest[i] >> 4];
+            hex[2 * i + 1] = digits[digest[i] & 15];
+        }
+        return hex;
+    }
+
+    bool enabled() const {
+        std::string mode = variable_or("AI_CACHE", "on");
+        return mode != "off" && mode != "0" && mode != "false";
+    }
+
+    bool lookup(const std::string &key, std::string &answer) {
+        load();
+        auto entry = index_.find(key);
+        if (entry == index_.end()) {
+            misses_++;
+            return false;
+        }
+
+        std::ifstream file(dir_ / key, std::ios::binary);
+        std::string header;
+        if (!file || !std::getline(file, header) || header != kMagic + key) {
+            forget(entry);
+            misses_++;
+            return false;
+        }
+        answer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+        entry->second.lastUse = ++clock_;
+        std::error_code ec;
+        fs::last_write_time(dir_ / key, fs::file_time_type::clock::now(), ec); // LRU order on disk
+        hits_++;
+        return true;
+    }
+
+    void store(const std::string &key, const std::string &answer) {
+        load();
+        std::error_code ec;
+        fs::create_directories(dir_, ec);
+        std::string temp = (dir_ / (key + ".tmp")).string();
+        {
+            std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+            if (!file) return;
+            file << kMagic << key << '\n' << answer;
+            if (!file) return;
+        }
+        fs::rename(temp, dir_ / key, ec); // readers never see half an entry
+        if (ec) return;
+
+        auto entry = index_.find(key);
+        if (entry != index_.end()) bytes_ -= entry->second.size;
+        std::uintmax_t size = kMagic.size() + key.size() + 1 + answer.size();
+        index_[key] = {size, ++clock_};
+        bytes_ += size;
+        evict();
+    }
+
+    void clear() {
+        load();
+        std::error_code ec;
+        for (const auto &entry : index_) fs::remove(dir_ / entry.first, ec);
+        index_.clear();
+        bytes_ = 0;
+    }
+
+    Stats stats() {
+        load();
+        return {index_.size(), bytes_, limit(), hits_, misses_};
+    }
+
+    const fs::path &dir() {
+        load();
+        return dir_;
+    }
+
+private:
+    struct Entry {
+        std::uintmax_t size;
+        uint64_t lastUse;
+    };
+
+    static inline const std::string kMagic = "myshell-aicache-2 "; // 2: SHA-256 keys
+
+    static fs::path configured_dir() {
+        std::string dir = variable_or("AI_CACHE_DIR", "");
+        if (!dir.empty()) return dir;
+        return myshell_dir() / "aicache";
+    }
+
+    std::uintmax_t limit() const {
+        try {
+            return std::stoull(variable_or("AI_CACHE_SIZE", "67108864"));
+        } catch (...) {
+            return 64ull << 20;
+        }
+    }
+
+    // Index the cache directory the first time it is used, ordered by the
+    // modification times left behind by earlier sessions
+    void load() {
+        fs::path dir = configured_dir();
+        if (loaded_ && dir == dir_) return;
+        loaded_ = true;
+        dir_ = dir;
+        index_.clear();
+        bytes_ = 0;
+
+        std::vector<std::pair<fs::file_time_type, std::string>> found;
+        std::error_code ec;
+        for (fs::directory_iterator it(dir_, ec), end; !ec && it != end; it.increment(ec)) {
+            std::string name = it->path().filename().string();
+            if (name.size() != 32 || !it->is_regular_file(ec)) continue;
+            std::error_code statError;
+            std::uintmax_t size = it->file_size(statError);
+            if (statError) continue;
+            found.emplace_back(it->last_write_time(statError), name);
+            index_[name] = {size, 0};
+            bytes_ += size;
+        }
+        std::sort(found.begin(), found.end());
+        for (const auto &file : found) index_[file.second].lastUse = ++clock_;
+        evict();
+    }
+
+    void forget(std::unordered_map<std::string, Entry>::iterator entry) {
+        std::error_code ec;
+        fs::remove(dir_ / entry->first, ec);
+        bytes_ -= entry->second.size;
+        index_.erase(entry);
+    }
+
+    void evict() {
+        std::uintmax_t cap = limit();
+        while (bytes_ > cap && !index_.empty()) {
+            auto oldest = std::min_element(index_.begin(), index_.end(), [](const auto &a, const auto &b) {
+                return a.second.lastUse < b.second.lastUse;
+            });
+            forget(oldest);
+        }
+    }
+
+    bool loaded_ = false;
+    fs::path dir_;
+    std::unordered_map<std::string, Entry> index_;
+    std::uintmax_t bytes_ = 0;
+    uint64_t clock_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
+
+AiCache ai_cache;
+
+// Called with each piece of an AI answer as it streams in
+using TokenSink = std::function<void(std::string_view)>;
+
+// JSON for the AI Path
+// Request bodies are written straight into a string and the fields needed
+// from responses are read in place, without building nlohmann::json
+// documents: a large prompt is escaped in one pass and a response is
+// scanned once for the answer, skipping everything else.
+
+// Length of the valid UTF-8 sequence starting at text[i], or 0
+size_t utf8_sequence_length(std::string_view text, size_t i) {
+    unsigned char c = text[i];
+    size_t length = c >= 0xf5 ? 0 : c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc2 ? 2 : 0;
+    if (length == 0 || i + length > text.size()) return 0;
+    for (size_t k = 1; k < length; k++) {
+        if ((static_cast<unsigned char>(text[i + k]) & 0xc0) != 0x80) return 0;
+    }
+    unsigned char next = text[i + 1];
+    if ((c == 0xe0 && next < 0xa0) || (c == 0xf0 && next < 0x90)) return 0; // overlong
+    if ((c == 0xed && next >= 0xa0) || (c == 0xf4 && next >= 0x90)) return 0; // surrogate, too large
+    return length;
+}
+
+void append_utf8(std::string &out, uint32_t code) {
+    if (code < 0x80) {
+        out += static_cast<char>(code);
+    } else if (code < 0x800) {
+        out += static_cast<char>(0xc0 | (code >> 6));
+        out += static_cast<char>(0x80 | (code & 0x3f));
+    } else if (code < 0x10000) {
+        out += static_cast<char>(0xe0 | (code >> 12));
+        out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (code & 0x3f));
+    } else {
+        out += static_cast<char>(0xf0 | (code >> 18));
+        out += static_cast<char>(0x80 | ((code >> 12) & 0x3f));
+        out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (code & 0x3f));
+    }
+}
+
+// Append `text` as a JSON string. Runs of plain characters are copied in one
+// go; invalid UTF-8 is replaced with U+FFFD rather than rejected.
+void append_json_string(std::string &out, std::string_view text) {
+    static const char hex[] = "0123456789abcdef";
+    out.reserve(out.size() + text.size() + 2);
+    out += '"';
+    size_t run = 0;
+    for (size_t i = 0; i < text.size();) {
+        unsigned char c = text[i];
+        if (c >= 0x20 && c != '"' && c != '\\' && c < 0x80) {
+            i++;
+            continue;
+        }
+        size_t length = c >= 0x80 ? utf8_sequence_length(text, i) : 0;
+        if (length) {
+            i += length;
+            continue;
+        }
+
+        out.append(text.data() + run, i - run);
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            default:
+                if (c >= 0x80) {
+                    out += "\\ufffd";
+                } else {
+                    out += "\\u00";
+                    out += hex[c >> 4];
+                    out += hex[c & 15];
+                }
+        }
+        run = ++i;
+    }
+    out.append(text.data() + run, text.size() - run);
+    out += '"';
+}
+
+// {"role":<role>,"content":<content>}
+void append_json_message(std::string &out, std::string_view role, std::string_view content) {
+    out += "{\"role\":";
+    append_json_string(out, role);
+    out += ",\"content\":";
+    append_json_string(out, content);
+    out += '}';
+}
+
+// Reads fields out of a JSON text in place. member() and element() move
+// into a value, skipping the ones before it without decoding them; only the
+// string asked for is decoded. Keys are compared as written, which is enough
+// for API responses.
+class JsonReader {
+public:
+    explicit JsonReader(std::string_view text) : text_(text) {}
+
+    // Move to the value of `key` in the object at the current position
+    bool member(std::string_view key) {
+        if (!at('{')) return false;
+        pos_++;
+        if (at('}')) return false;
+        while (at('"')) {
+            size_t start = pos_ + 1;
+            if (!skip_string()) return false;
+            std::string_view name = text_.substr(start, pos_ - 1 - start);
+            if (!at(':')) return false;
+            pos_++;
+            if (name == key) return !at('\0');
+            if (!skip_value() || !at(',')) return false;
+            pos_++;
+        }
+        return false;
+    }
+
+    // Move to element `index` of the array at the current position
+    bool element(size_t index) {
+        if (!at('[')) return false;
+        pos_++;
+        if (at(']')) return false;
+        for (size_t i = 0; i < index; i++) {
+            if (!skip_value() || !at(',')) return false;
+            pos_++;
+        }
+        return !at('\0');
+    }
+
+    // Decode the string at the current position
+    bool string(std::string &out) {
+        if (!at('"')) return false;
+        size_t start = pos_ + 1;
+        if (!skip_string()) return false;
+        std::string_view raw = text_.substr(start, pos_ - 1 - start);
+
+        out.clear();
+        out.reserve(raw.size());
+        for (size_t i = 0;;) {
+            size_t slash = raw.find('\\', i);
+            out.append(raw.substr(i, slash - i));
+            if (slash == std::string_view::npos) return true;
+            if (slash + 1 == raw.size()) return false;
+            i = slash + 2;
+            switch (raw[slash + 1]) {
+                case '"': out += '"'; break;
+                case '\\': out += '\\'; break;
+                case '/': out += '/'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u': {
+                    uint32_t code, low;
+                    if (!hex4(raw, i, code)) return false;
+                    i += 4;
+                    if (code >= 0xd800 && code < 0xdc00 && raw.substr(i, 2) == "\\u" && hex4(raw, i + 2, low) &&
+                        low >= 0xdc00 && low < 0xe000) {
+                        code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                        i += 6;
+                    } else if (code >= 0xd800 && code < 0xe000) {
+                        code = 0xfffd; // unpaired surrogate
+                    }
+                    append_utf8(out, code);
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+    }
+
+private:
+    // Skip whitespace; true if the next character is `c` ('\0' at the end)
+    bool at(char c) {
+        while (pos_ < text_.size() && (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n' ||
+                                       text_[pos_] == '\r')) {
+            pos_++;
+        }
+        return pos_ < text_.size() ? text_[pos_] == c : c == '\0';
+    }
+
+    // Skip the string starting at pos_; the closing quote is the first one
+    // not preceded by an odd number of backslashes
+    bool skip_string() {
+        for (size_t from = pos_ + 1;;) {
+            const void *quote = memchr(text_.data() + from, '"', text_.size() - from);
+            if (!quote) return false;
+            size_t end = static_cast<const char*>(quote) - text_.data();
+            size_t slashes = 0;
+            while (text_[end - 1 - slashes] == '\\') slashes++;
+            if (slashes % 2 == 0) {
+                pos_ = end + 1;
+                return true;
+            }
+            from = end + 1;
+        }
+    }
+
+    bool skip_value() {
+        if (at('"')) return skip_string();
+        if (at('{') || at('[')) {
+            for (int depth = 0; pos_ < text_.size();) {
+                char c = text_[pos_];
+                if (c == '"') {
+                    if (!skip_string()) return false;
+                    continue;
+                }
+                if (c == '{' || c == '[') depth++;
+                if ((c == '}' || c == ']') && --depth == 0) {
+                    pos_++;
+                    return true;
+                }
+                pos_++;
+            }
+            return false;
+        }
+        size_t start = pos_; // number, true, false or null
+        while (pos_ < text_.size() && !strchr(",}] \t\r\n", text_[pos_])) pos_++;
+        return pos_ > start;
+    }
+
+    static bool hex4(std::string_view text, size_t i, uint32_t &value) {
+        if (i + 4 > text.size()) return false;
+        value = 0;
+        for (size_t k = i; k < i + 4; k++) {
+            char c = text[k];
+            int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                      : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            if (digit < 0) return false;
+            value = value * 16 + digit;
+        }
+        return true;
+    }
+
+    std::string_view text_;
+    size_t pos_ = 0;
+};
+
+std::string parse_groq_response(const std::string &body) {
+    std::string text;
+    JsonReader answer(body);
+    if (answer.member("choices") && answer.element(0) && answer.member("message") && answer.member("content") &&
+        answer.string(text)) {
+        return text;
+    }
+    JsonReader error(body);
+    if (error.member("error") && error.member("message") && error.string(text)) {
+        return "API Error: " + text;
+    }
+    if (json::accept(body)) return "Error parsing response from Groq API";
+    show_error("Failed to parse Groq API response");
+    return "Error parsing response";
+}
+
+// Longest answer requested, in tokens, and the sampling temperature
+constexpr int kAnswerTokens = 1024;
+constexpr const char *kTemperature = "0.7";
+
+// Write the request body for one chat completion into `out`. `history`
+// holds earlier messages of a conversation, already serialized and separated
+// by commas, which go in front of the new message as they are.
+void write_groq_request(std::string &out, std::string_view prompt, std::string_view model, bool stream,
+                        std::string_view history = {}) {
+    out.clear();
+    out += "{\"model\":";
+    append_json_string(out, model);
+    out += ",\"messages\":[";
+    if (!history.empty()) out.append(history) += ',';
+    append_json_message(out, "user", prompt);
+    out += "],\"temperature\":";
+    out += kTemperature;
+    out += ",\"max_tokens\":";
+    out += std::to_string(kAnswerTokens);
+    if (stream) out += ",\"stream\":true";
+    out += '}';
+}
+
+// Cache key for a request, or "" when the cache is off. Everything that
+// shapes the answer goes into the key; no system prompt is sent yet, but it
+// keeps its slot so adding one changes keys.
+std::string groq_cache_key(const std::string &prompt, const std::string &model, std::string_view history = {}) {
+    if (!ai_cache.enabled()) return "";
+    const std::string systemPrompt;
+    std::string material = ai_backend().id();
+    material.append("\0", 1).append(model);
+    material.append("\0", 1).append(systemPrompt).append("\0", 1).append(history).append("\0", 1);
+    material.append(prompt).append("\0", 1);
+    material.append(kTemperature).append(" ").append(std::to_string(kAnswerTokens));
+    return AiCache::key(material);
+}
+
+// Request bodies are built here; the capacity is kept between requests
+std::string request_buffer;
+
+// Make API request to Groq. With a sink the answer is streamed: each piece
+// goes to the sink as soon as it arrives, and the whole answer is returned.
+// `history` continues a conversation (see groq_request_body). A request that
+// fails sets last_status to 1.
+std::string call_groq_api(const std::string &prompt, const std::string &model = "llama3-70b-8192",
+                          const TokenSink &sink = nullptr, std::string_view history = {}) {
+    if (!ai_key_ready()) return "Error: API key not configured";
+    
+    std::string cacheKey = groq_cache_key(prompt, model, history);
+    if (!cacheKey.empty()) {
+        std::string cached;
+        if (ai_cache.lookup(cacheKey, cached)) {
+            if (sink) sink(cached);
+            return cached;
+        }
+    }
+    std::string &body = request_buffer;
+    write_groq_request(body, prompt, model, sink != nullptr, history);
+    
+    std::string readBuffer;
+    std::string streamed;
+    std::string streamError;
+    std::string piece;
+    SseParser parser([&](std::string_view event) {
+        if (event == "[DONE]") return;
+        JsonReader chunk(event);
+        if (chunk.member("choices") && chunk.element(0) && chunk.member("delta") && chunk.member("content") &&
+            chunk.string(piece)) {
+            streamed += piece;
+            sink(piece);
+            return;
+        }
+        // Chunks without content (the role, the finish reason) are skipped
+        JsonReader error(event);
+        if (error.member("error") && error.member("message") && error.string(piece)) streamError = piece;
+        else if (!json::accept(event)) streamError = "Bad stream chunk";
+    });
+
+    long httpCode;
+    std::cout << "Asking AI... " << std::flush;
+    
+    CURLcode res = sink
+        ? ai_backend().post("chat/completions", body, SseWriteCallback, &parser, httpCode)
+        : ai_backend().post("chat/completions", body, WriteCallback, &readBuffer, httpCode);
+    if (sink) parser.finish();
+    
+    // Check for errors
+    if (res == CURLE_FAILED_INIT) {
+        last_status = 1;
+        return "Error initializing CURL";
+    }
+    if (res == CURLE_ABORTED_BY_CALLBACK) {
+        show_error("AI request cancelled");
+        return streamed;
+    }
+    if (res != CURLE_OK) {
+        show_error("Groq API request failed: " + std::string(curl_easy_strerror(res)));
+        return sink && !streamed.empty() ? streamed : "Error calling Groq API";
+    }
+    
+    std::string answer;
+    if (!sink) {
+        answer = parse_groq_response(readBuffer);
+    } else if (!streamError.empty()) {
+        answer = "API Error: " + streamError;
+    } else if (!parser.sawEvent()) {
+        // Errors arrive as a plain JSON body rather than an event stream
+        answer = parse_groq_response(parser.raw());
+    } else {
+        answer = streamed;
+    }
+
+    bool ok = httpCode == 200 && streamError.empty() && (!sink || parser.sawEvent());
+    if (!ok) last_status = 1;
+    else if (!cacheKey.empty()) ai_cache.store(cacheKey, answer);
+    return answer;
+}
+
+// Batch Requests
+// Several prompts are sent at once over the HTTP backend's multi handle, with
+// at most AI_CONCURRENCY (default 4) requests in flight; other backends
+// answer them one at a time. A request answered
+// with 429 or 503 is retried after the server's Retry-After delay, or an
+// exponential backoff if it gives none, up to kBatchRetries times. Answers
+// are handed to `done` in prompt order, each as soon as it and every answer
+// before it are complete.
+using BatchCallback = std::function<void(size_t index, const std::string &answer, bool ok)>;
+
+constexpr int kBatchRetries = 4;
+
+struct BatchRequest {
+    std::string body;
+    std::string cacheKey;
+    std::string response;
+    std::string answer;
+    CURL *handle = nullptr;
+    int attempts = 0;
+    std::chrono::steady_clock::time_point notBefore;
+    bool finished = false;
+    bool ok = false;
+};
+
+void call_groq_batch(const std::vector<std::string> &prompts, const std::string &model, const BatchCallback &done) {
+    if (!ai_key_ready()) return;
+
+    size_t concurrency = 4;
+    try {
+        concurrency = std::max(1, std::stoi(variable_or("AI_CONCURRENCY", "4")));
+    } catch (...) {}
+
+    std::vector<BatchRequest> requests(prompts.size());
+    std::deque<size_t> queue;
+    for (size_t i = 0; i < prompts.size(); i++) {
+        write_groq_request(requests[i].body, prompts[i], model, false);
+        requests[i].cacheKey = groq_cache_key(prompts[i], model);
+        if (!requests[i].cacheKey.empty() && ai_cache.lookup(requests[i].cacheKey, requests[i].answer)) {
+            requests[i].finished = requests[i].ok = true;
+        } else {
+            queue.push_back(i);
+        }
+    }
+
+    size_t next = 0;
+    auto deliver = [&] {
+        for (; next < requests.size() && requests[next].finished; next++) {
+            done(next, requests[next].answer, requests[next].ok);
+        }
+    };
+    deliver();
+
+    bool failed = false;
+    auto complete = [&](BatchRequest &request, CURLcode res, long httpCode, curl_off_t retryAfter) {
+        if (res == CURLE_OK && (httpCode == 429 || httpCode == 503) && request.attempts < kBatchRetries) {
+            long delay = retryAfter > 0 ? static_cast<long>(retryAfter) : 1L << request.attempts;
+            request.attempts++;
+            request.notBefore = std::chrono::steady_clock::now() + std::chrono::seconds(delay);
+            queue.push_back(&request - requests.data());
+            return;
+        }
+
+        if (res != CURLE_OK) {
+            request.answer = "Groq API request failed: " + std::string(curl_easy_strerror(res));
+        } else {
+            request.answer = parse_groq_response(request.response);
+            request.ok = httpCode == 200;
+            if (request.ok && !request.cacheKey.empty()) ai_cache.store(request.cacheKey, request.answer);
+        }
+        failed = failed || !request.ok;
+        request.finished = true;
+    };
+
+    InterruptGuard interrupt;
+    HttpBackend *http = dynamic_cast<HttpBackend*>(&ai_backend());
+    while (!http && !queue.empty() && !ai_interrupted) {
+        BatchRequest &request = requests[queue.front()];
+        queue.pop_front();
+        std::this_thread::sleep_until(request.notBefore);
+        long httpCode;
+        request.response.clear();
+        CURLcode res = ai_backend().post("chat/completions", request.body, WriteCallback, &request.response, httpCode);
+        complete(request, res, httpCode, 0);
+        deliver();
+    }
+
+    CURLM *multi = http ? http->multi() : nullptr;
+    std::string url = http ? http->url("chat/completions") : "";
+    size_t running = 0;
+
+    while (http && next < requests.size() && !ai_interrupted) {
+        // Start waiting requests whose backoff has passed
+        auto now = std::chrono::steady_clock::now();
+        for (auto it = queue.begin(); it != queue.end() && running < concurrency && multi;) {
+            BatchRequest &request = requests[*it];
+            if (request.notBefore > now) {
+                ++it;
+                continue;
+            }
+            request.handle = curl_easy_init();
+            if (!request.handle) break;
+            request.response.clear();
+            http->configure(request.handle);
+            curl_easy_setopt(request.handle, CURLOPT_URL, url.c_str());
+            curl_easy_setopt(request.handle, CURLOPT_POSTFIELDS, request.body.c_str());
+            curl_easy_setopt(request.handle, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(request.body.size()));
+            curl_easy_setopt(request.handle, CURLOPT_WRITEFUNCTION, WriteCallback);
+            curl_easy_setopt(request.handle, CURLOPT_WRITEDATA, &request.response);
+            curl_easy_setopt(request.handle, CURLOPT_PRIVATE, &request);
+            curl_easy_setopt(request.handle, CURLOPT_PIPEWAIT, 0L); // open connections in parallel
+            curl_multi_add_handle(multi, request.handle);
+            running++;
+            it = queue.erase(it);
+        }
+        if (!multi || (running == 0 && queue.empty())) break;
+
+        int active;
+        curl_multi_perform(multi, &active);
+
+        int left;
+        while (CURLMsg *msg = curl_multi_info_read(multi, &left)) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            BatchRequest *request;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &request);
+            long httpCode = 0;
+            curl_off_t retryAfter = 0;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &httpCode);
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_RETRY_AFTER, &retryAfter);
+            CURLcode res = msg->data.result;
+            curl_multi_remove_handle(multi, msg->easy_handle);
+            curl_easy_cleanup(msg->easy_handle);
+            request->handle = nullptr;
+            running--;
+            complete(*request, res, httpCode, retryAfter);
+        }
+        deliver();
+
+        if (next < requests.size()) curl_multi_poll(multi, nullptr, 0, 100, nullptr);
+    }
+
+    // Requests still in flight after Ctrl-C
+    for (BatchRequest &request : requests) {
+        if (!request.handle) continue;
+        curl_multi_remove_handle(multi, request.handle);
+        curl_easy_cleanup(request.handle);
+    }
+    if (ai_interrupted) show_error("AI request cancelled");
+    else if (next < requests.size()) show_error("Could not start AI requests");
+    else if (failed) last_status = 1;
+}
+
+// Background AI Requests
+// `ai <prompt> &` and `aiasync` return to the prompt at once. The request
+// runs on an event loop thread with its own curl multi handle; the thread
+// only moves bytes, so everything touching shell state (parsing the answer,
+// the cache, variables, output) happens on the main thread when the result
+// is delivered: before the next prompt, or in `aiwait`. Background requests
+// do not take part in the `ai` conversation.
+struct AsyncAiRequest {
+    int id;
+    std::string prompt;
+    std::string variable; // receives the answer; printed if empty
+    std::string cacheKey;
+    std::string body;
+    std::string response;
+    std::string answer; // set up front for cache hits and non-HTTP backends
+    CURL *handle = nullptr;
+    curl_slist *headers = nullptr;
+    CURLcode result = CURLE_OK;
+    long httpCode = 0;
+    std::atomic<bool> finished{false};
+};
+
+class AiEventLoop {
+public:
+    ~AiEventLoop() {
+        if (thread_.joinable()) {
+            stop_ = true;
+            curl_multi_wakeup(multi_);
+            thread_.join();
+        }
+        for (const auto &request : running_) release(*request);
+        if (multi_) curl_multi_cleanup(multi_);
+    }
+
+    // Hand over a request whose handle is ready to go
+    bool submit(std::shared_ptr<AsyncAiRequest> request) {
+        if (!multi_) multi_ = curl_multi_init();
+        if (!multi_) return false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            incoming_.push_back(std::move(request));
+        }
+        if (!thread_.joinable()) thread_ = std::thread([this] { run(); });
+        curl_multi_wakeup(multi_);
+        return true;
+    }
+
+    // Wait until `done` holds, a request finishes or `timeout` passes
+    template <typename Predicate>
+    void wait(std::chrono::milliseconds timeout, Predicate done) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        finishedSignal_.wait_for(lock, timeout, done);
+    }
+
+private:
+    void run() {
+        while (!stop_) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (auto &request : incoming_) {
+                    curl_multi_add_handle(multi_, request->handle);
+                    running_.push_back(std::move(request));
+                }
+                incoming_.clear();
+            }
+
+            int active;
+            curl_multi_perform(multi_, &active);
+            int left;
+            while (CURLMsg *msg = curl_multi_info_read(multi_, &left)) {
+                if (msg->msg != CURLMSG_DONE) continue;
+                auto it = std::find_if(running_.begin(), running_.end(),
+                                       [msg](const auto &request) { return request->handle == msg->easy_handle; });
+                if (it == running_.end()) continue;
+                AsyncAiRequest &request = **it;
+                request.result = msg->data.result;
+                curl_easy_getinfo(request.handle, CURLINFO_RESPONSE_CODE, &request.httpCode);
+                release(request);
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    request.finished = true;
+                }
+                finishedSignal_.notify_all();
+                running_.erase(it);
+            }
+            curl_multi_poll(multi_, nullptr, 0, 1000, nullptr);
+        }
+    }
+
+    void release(AsyncAiRequest &request) {
+        curl_multi_remove_handle(multi_, request.handle);
+        curl_easy_cleanup(request.handle);
+        curl_slist_free_all(request.headers);
+        request.handle = nullptr;
+        request.headers = nullptr;
+    }
+
+    CURLM *multi_ = nullptr;
+    std::thread thread_;
+    std::atomic<bool> stop_{false};
+    std::mutex mutex_;
+    std::condition_variable finishedSignal_;
+    std::vector<std::shared_ptr<AsyncAiRequest>> incoming_;
+    std::vector<std::shared_ptr<AsyncAiRequest>> running_; // loop thread only
+};
+
+// Created after the HTTP backend, so it is destroyed before curl is cleaned up
+AiEventLoop &ai_event_loop() {
+    http_backend();
+    static AiEventLoop loop;
+    return loop;
+}
+
+std::vector<std::shared_ptr<AsyncAiRequest>> ai_requests;
+int last_ai_request_id = 0;
+
+// Start a request in the background and print its handle, also kept in $AI_JOB
+void start_async_ai(const std::string &prompt, const std::string &variable) {
+    if (!ai_key_ready()) return;
+    std::string model = variable_or("AI_MODEL", "llama3-70b-8192");
+
+    auto request = std::make_shared<AsyncAiRequest>();
+    request->id = ++last_ai_request_id;
+    request->prompt = prompt;
+    request->variable = variable;
+    request->cacheKey = groq_cache_key(prompt, model);
+    write_groq_request(request->body, prompt, model, false);
+
+    HttpBackend *http = dynamic_cast<HttpBackend*>(&ai_backend());
+    if (!request->cacheKey.empty() && ai_cache.lookup(request->cacheKey, request->answer)) {
+        request->httpCode = 200;
+        request->finished = true;
+    } else if (!http) {
+        // Backends without a transport answer right away
+        request->result = ai_backend().post("chat/completions", request->body, WriteCallback, &request->response,
+                                            request->httpCode);
+        request->finished = true;
+    } else {
+        request->handle = curl_easy_init();
+        if (!request->handle) {
+            show_error("Could not start AI request");
+            return;
+        }
+        std::string url = http->url("chat/completions");
+        http->configure(request->handle);
+        // The event loop keeps its own connections: a connection shared with
+        // the foreground handle would not wake it when it is released
+        curl_easy_setopt(request->handle, CURLOPT_SHARE, nullptr);
+        request->headers = HttpBackend::build_headers(); // outlives a key change
+        curl_easy_setopt(request->handle, CURLOPT_HTTPHEADER, request->headers);
+        curl_easy_setopt(request->handle, CURLOPT_NOPROGRESS, 1L); // Ctrl-C is for the foreground
+        curl_easy_setopt(request->handle, CURLOPT_PIPEWAIT, 0L);   // run alongside other requests
+        curl_easy_setopt(request->handle, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(request->handle, CURLOPT_POSTFIELDS, request->body.c_str());
+        curl_easy_setopt(request->handle, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(request->body.size()));
+        curl_easy_setopt(request->handle, CURLOPT_WRITEFUNCTION, WriteCallback);
+        curl_easy_setopt(request->handle, CURLOPT_WRITEDATA, &request->response);
+        if (!ai_event_loop().submit(request)) {
+            curl_easy_cleanup(request->handle);
+            curl_slist_free_all(request->headers);
+            show_error("Could not start AI request");
+            return;
+        }
+    }
+
+    ai_requests.push_back(request);
+    assign_variable("AI_JOB", std::to_string(request->id));
+    std::cout << "[ai " << request->id << "]" << std::endl;
+}
+
+// Store or print the answer of a finished request; returns whether it succeeded
+bool deliver_async_ai(AsyncAiRequest &request) {
+    bool ok = request.result == CURLE_OK && request.httpCode == 200;
+    std::string answer = request.answer;
+    if (request.result != CURLE_OK) {
+        answer = "Groq API request failed: " + std::string(curl_easy_strerror(request.result));
+    } else if (answer.empty()) {
+        answer = parse_groq_response(request.response);
+        if (ok && !request.cacheKey.empty()) ai_cache.store(request.cacheKey, answer);
+    }
+
+    std::string title = request.prompt.size() > 40 ? request.prompt.substr(0, 37) + "..." : request.prompt;
+    std::cout << "[ai " << request.id << "] " << (ok ? "Done" : "Failed") << "\t" << title;
+    if (ok && !request.variable.empty()) {
+        assign_variable(request.variable, answer);
+        std::cout << " -> $" << request.variable << std::endl;
+    } else {
+        std::cout << "\n\033[1;36m" << answer << "\033[0m\n" << std::endl;
+    }
+    return ok;
+}
+
+// Deliver and forget background AI requests that have finished
+void report_finished_ai() {
+    for (auto it = ai_requests.begin(); it != ai_requests.end();) {
+        if ((*it)->finished) {
+            deliver_async_ai(**it);
+            it = ai_requests.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Prints a streamed AI answer in one color. If nothing was streamed (an
+// error, or output that is not streamed) finish() prints the result instead.
+struct StreamPrinter {
+    const char *color;
+    bool started = false;
+
+    explicit StreamPrinter(const char *color) : color(color) {}
+
+    TokenSink sink() {
+        return [this](std::string_view piece) {
+            if (!started) {
+                std::cout << "\n" << color;
+                started = true;
+            }
+            std::cout << piece << std::flush;
+        };
+    }
+
+    void finish(const std::string &result) {
+        if (!started) std::cout << "\n" << color << result;
+        std::cout << "\033[0m\n" << std::endl;
+    }
+};
+
+size_t estimate_tokens(std::string_view text);
+
+// AI Conversation
+// `ai` remembers the conversation so follow-up questions have context. The
+// messages are kept in a ring buffer, oldest exchanges dropped first, within
+// AI_MEMORY_TOKENS (default 2048) tokens. Each message is stored already
+// serialized, so a request is built by joining strings instead of
+// re-serializing the history. Messages are appended to ~/.myshell/aimemory
+// (AI_MEMORY_FILE), one JSON object per line, and read back the next time
+// the shell starts. AI_MEMORY=off makes `ai` stateless.
+class Conversation {
+public:
+    struct Message {
+        std::string json; // {"role":...,"content":...}
+        size_t tokens;
+    };
+
+    bool enabled() const {
+        std::string mode = variable_or("AI_MEMORY", "on");
+        return mode != "off" && mode != "0" && mode != "false";
+    }
+
+    // Earlier messages as comma-separated JSON objects
+    const std::string &history() {
+        load();
+        return history_;
+    }
+
+    const std::deque<Message> &messages() {
+        load();
+        return messages_;
+    }
+
+    size_t tokens() {
+        load();
+        return tokens_;
+    }
+
+    void add(const std::string &question, const std::string &answer) {
+        load();
+        std::string user, assistant;
+        append_json_message(user, "user", question);
+        append_json_message(assistant, "assistant", answer);
+        std::string lines = user + '\n' + assistant + '\n';
+        push(std::move(user));
+        push(std::move(assistant));
+        trim();
+
+        // Rewrite the file once it is mostly messages that were trimmed away
+        fileMessages_ += 2;
+        if (fileMessages_ > 2 * messages_.size() + kMaxMessages) {
+            compact();
+            return;
+        }
+        std::error_code ec;
+        fs::create_directories(path_.parent_path(), ec);
+        std::ofstream file(path_, std::ios::app | std::ios::binary);
+        file << lines;
+    }
+
+    void reset() {
+        load();
+        messages_.clear();
+        history_.clear();
+        tokens_ = 0;
+        fileMessages_ = 0;
+        std::error_code ec;
+        fs::remove(path_, ec);
+    }
+
+private:
+    static constexpr size_t kMaxMessages = 64;
+
+    static fs::path configured_path() {
+        std::string path = variable_or("AI_MEMORY_FILE", "");
+        return path.empty() ? myshell_dir() / "aimemory" : fs::path(path);
+    }
+
+    size_t budget() const {
+        try {
+            return std::stoul(variable_or("AI_MEMORY_TOKENS", "2048"));
+        } catch (...) {
+            return 2048;
+        }
+    }
+
+    void push(std::string serialized) {
+        size_t tokens = estimate_tokens(serialized);
+        if (!history_.empty()) history_ += ',';
+        history_ += serialized;
+        tokens_ += tokens;
+        messages_.push_back({std::move(serialized), tokens});
+    }
+
+    // Drop whole exchanges from the front until the budget is met
+    void trim() {
+        size_t limit = budget();
+        while (!messages_.empty() && (tokens_ > limit || messages_.size() > kMaxMessages)) {
+            for (int i = 0; i < 2 && !messages_.empty(); i++) {
+                const Message &oldest = messages_.front();
+                history_.erase(0, std::min(history_.size(), oldest.json.size() + 1));
+                tokens_ -= oldest.tokens;
+                messages_.pop_front();
+            }
+        }
+    }
+
+    void load() {
+        fs::path path = configured_path();
+        if (loaded_ && path == path_) return;
+        loaded_ = true;
+        path_ = path;
+        messages_.clear();
+        history_.clear();
+        tokens_ = 0;
+        fileMessages_ = 0;
+
+        std::ifstream file(path_, std::ios::binary);
+        std::string line;
+        while (std::getline(file, line)) {
+            // A torn last line from an interrupted write is skipped
+            if (!json::accept(line)) continue;
+            push(std::move(line));
+            fileMessages_++;
+        }
+        trim();
+    }
+
+    void compact() {
+        std::string temp = path_.string() + ".tmp";
+        {
+            std::ofstream file(temp, std::ios::trunc | std::ios::binary);
+            for (const Message &message : messages_) file << message.json << '\n';
+            if (!file) return;
+        }
+        std::error_code ec;
+        fs::rename(temp, path_, ec);
+        if (!ec) fileMessages_ = messages_.size();
+    }
+
+    bool loaded_ = false;
+    fs::path path_;
+    std::deque<Message> messages_;
+    std::string history_;
+    size_t tokens_ = 0;
+    size_t fileMessages_ = 0; // lines in the file
+};
+
+Conversation conversation;
+
+// AI Command Implementation
+std::string ai_command(const Args &tokens, const TokenSink &sink = nullptr) {
+    if (tokens.size() < 2) {
+        show_error("Usage: ai <prompt>");
+        return "";
+    }
+    
+    // Combine all tokens after "ai" into the prompt
+    std::string prompt;
+    for (size_t i = 1; i < tokens.size(); i++) {
+        prompt.append(tokens[i]) += " ";
+    }
+    
+    std::string model = variable_or("AI_MODEL", "llama3-70b-8192");
+    if (!conversation.enabled()) return call_groq_api(prompt, model, sink);
+
+    std::string answer = call_groq_api(prompt, model, sink, conversation.history());
+    if (last_status == 0) conversation.add(prompt, answer);
+    return answer;
+}
+
+// AI Code Command
+std::string ai_code_command(const Args &tokens, const TokenSink &sink = nullptr) {
+    if (tokens.size() < 3) {
+        show_error("Usage: aicode <language> <description>");
+        return "";
+    }
+    
+    std::string language(tokens[1]);
+    
+    // Combine all tokens after language into the description
+    std::string description;
+    for (size_t i = 2; i < tokens.size(); i++) {
+        description.append(tokens[i]) += " ";
+    }
+    
+    std::string prompt = "Write a " + language + " program that " + description + 
+                          ". Provide only the code without explanations.";
+    
+    std::string model = variable_or("AI_MODEL", "llama3-70b-8192");
+    return call_groq_api(prompt, model, sink);
+}
+
+// Source Chunking
+// Files too large for one request are split into chunks that fit the
+// model's context window. Tokens are estimated the way BPE tokenizers split
+// code: a run of letters and digits costs about one token per four
+// characters, every other visible character and each newline one token.
+// Chunks end after a blank line or a closing brace in column 0 where
+// possible, so functions are not cut in half.
+size_t estimate_tokens(std::string_view text) {
+    auto isWord = [](unsigned char c) { return std::isalnum(c) || c == '_' || c >= 0x80; };
+    size_t tokens = 0;
+    for (size_t i = 0; i < text.size();) {
+        unsigned char c = text[i];
+        if (isWord(c)) {
+            size_t start = i;
+            while (i < text.size() && isWord(text[i])) i++;
+            tokens += (i - start + 3) / 4;
+        } else {
+            if (c == '\n' || !std::isspace(c)) tokens++;
+            i++;
+        }
+    }
+    return tokens;
+}
+
+// Context window of a model: AI_CONTEXT if set, else the size in the model's
+// name (llama3-70b-8192), else 8192 tokens
+size_t model_context(const std::string &model) {
+    std::string configured = variable_or("AI_CONTEXT", model.substr(model.rfind('-') + 1));
+    try {
+        size_t context = std::stoul(configured);
+        if (context >= 1024) return context;
+    } catch (...) {}
+    return 8192;
+}
+
+// Largest chunk to send, in tokens. A fix comes back as the whole chunk
+// rewritten, so the chunk has to fit in the answer; an explanation only has
+// to fit in the context window next to its answer. AI_CHUNK_TOKENS overrides.
+size_t chunk_budget(const std::string &model, bool rewrite) {
+    try {
+        std::string configured = variable_or("AI_CHUNK_TOKENS", "");
+        if (!configured.empty()) return std::max<size_t>(64, std::stoul(configured));
+    } catch (...) {}
+    if (rewrite) return kAnswerTokens * 3 / 4;
+    size_t context = model_context(model);
+    size_t reserved = kAnswerTokens + 256; // the answer and the instructions
+    return context > 2 * reserved ? context - reserved : context / 2;
+}
+
+struct SourceChunk {
+    size_t firstLine; // 1-based, inclusive
+    size_t lastLine;
+    std::string text;
+};
+
+std::vector<SourceChunk> chunk_source(std::string_view code, size_t budget) {
+    std::vector<SourceChunk> chunks;
+    size_t start = 0, startLine = 1, tokens = 0;
+    size_t boundary = 0, boundaryLine = 0, boundaryTokens = 0; // last good cut in this chunk
+    size_t line = 1;
+
+    for (size_t pos = 0; pos < code.size(); line++) {
+        size_t end = code.find('\n', pos);
+        end = end == std::string_view::npos ? code.size() : end + 1;
+        std::string_view text = code.substr(pos, end - pos);
+        size_t cost = estimate_tokens(text);
+
+        while (tokens + cost > budget && pos > start) {
+            // Cut at the last boundary unless that leaves a sliver of a chunk
+            bool atBoundary = boundary > start && boundaryTokens * 4 >= budget;
+            size_t cut = atBoundary ? boundary : pos;
+            size_t cutLine = atBoundary ? boundaryLine : line;
+            chunks.push_back({startLine, cutLine - 1, std::string(code.substr(start, cut - start))});
+            tokens = atBoundary ? tokens - boundaryTokens : 0;
+            start = cut;
+            startLine = cutLine;
+            boundary = 0;
+        }
+
+        tokens += cost;
+        pos = end;
+        if (text.find_first_not_of(" \t\r\n") == std::string_view::npos || text[0] == '}') {
+            boundary = pos;
+            boundaryLine = line + 1;
+            boundaryTokens = tokens;
+        }
+    }
+    if (start < code.size()) chunks.push_back({startLine, line - 1, std::string(code.substr(start))});
+    return chunks;
+}
+
+// Unified Diff
+// Line diff with Myers' O(ND) algorithm, written as a unified diff with three
+// lines of context. Lines keep their '\n' so a missing final newline shows.
+enum class DiffOp { Equal, Delete, Insert };
+
+// Past this many differing lines the search is cut short and the changed
+// region is shown as removed and re-added as a whole
+constexpr int kDiffCostLimit = 4000;
+
+std::vector<std::string_view> split_lines(std::string_view text) {
+    std::vector<std::string_view> lines;
+    for (size_t pos = 0; pos < text.size();) {
+        size_t end = text.find('\n', pos);
+        end = end == std::string_view::npos ? text.size() : end + 1;
+        lines.push_back(text.substr(pos, end - pos));
+        pos = end;
+    }
+    return lines;
+}
+
+std::vector<DiffOp> diff_lines(const std::vector<std::string_view> &a, const std::vector<std::string_view> &b) {
+    // A common prefix and suffix need no search
+    size_t prefix = 0, suffix = 0;
+    while (prefix < a.size() && prefix < b.size() && a[prefix] == b[prefix]) prefix++;
+    while (suffix < a.size() - prefix && suffix < b.size() - prefix &&
+           a[a.size() - 1 - suffix] == b[b.size() - 1 - suffix]) {
+        suffix++;
+    }
+    int n = static_cast<int>(a.size() - prefix - suffix);
+    int m = static_cast<int>(b.size() - prefix - suffix);
+
+    // v[k] is the furthest x reached on diagonal k = x - y; trace keeps v
+    // for every cost d so the path can be walked back
+    int offset = n + m + 1;
+    std::vector<int> v(2 * offset + 1, 0);
+    std::vector<std::vector<int>> trace;
+    int cost = -1;
+    for (int d = 0; d <= n + m && d <= kDiffCostLimit && cost < 0; d++) {
+        for (int k = -d; k <= d; k += 2) {
+            int x = (k == -d || (k != d && v[offset + k - 1] < v[offset + k + 1])) ? v[offset + k + 1]
+                                                                                  : v[offset + k - 1] + 1;
+            int y = x - k;
+            while (x < n && y < m && a[prefix + x] == b[prefix + y]) x++, y++;
+            v[offset + k] = x;
+            if (x >= n && y >= m) {
+                cost = d;
+                break;
+            }
+        }
+        trace.emplace_back(v.begin() + offset - d, v.begin() + offset + d + 1);
+    }
+
+    std::vector<DiffOp> middle; // built back to front
+    if (cost < 0) {
+        middle.assign(m, DiffOp::Insert);
+        middle.insert(middle.end(), n, DiffOp::Delete);
+    } else {
+        int x = n, y = m;
+        for (int d = cost; d > 0; d--) {
+            const std::vector<int> &previous = trace[d - 1];
+            auto furthest = [&](int k) { return previous[k + d - 1]; };
+            int k = x - y;
+            int prevK = (k == -d || (k != d && furthest(k - 1) < furthest(k + 1))) ? k + 1 : k - 1;
+            int prevX = furthest(prevK), prevY = prevX - prevK;
+            for (; x > prevX && y > prevY; x--, y--) middle.push_back(DiffOp::Equal);
+            middle.push_back(prevK == k + 1 ? DiffOp::Insert : DiffOp::Delete);
+            x = prevX;
+            y = prevY;
+        }
+        for (; x > 0; x--) middle.push_back(DiffOp::Equal);
+    }
+
+    std::vector<DiffOp> ops(prefix, DiffOp::Equal);
+    ops.insert(ops.end(), middle.rbegin(), middle.rend());
+    ops.insert(ops.end(), suffix, DiffOp::Equal);
+    return ops;
+}
+
+// Unified diff from `before` to `after`, or "" if they are the same
+std::string unified_diff(std::string_view before, std::string_view after, const std::string &path) {
+    constexpr size_t kContext = 3;
+    std::vector<std::string_view> a = split_lines(before), b = split_lines(after);
+    std::vector<DiffOp> ops = diff_lines(a, b);
+
+    // Line of each text at which every op starts
+    std::vector<size_t> aLine(ops.size() + 1, 0), bLine(ops.size() + 1, 0);
+    for (size_t i = 0; i < ops.size(); i++) {
+        aLine[i + 1] = aLine[i] + (ops[i] != DiffOp::Insert);
+        bLine[i + 1] = bLine[i] + (ops[i] != DiffOp::Delete);
+    }
+    auto range = [](size_t start, size_t count) {
+        if (count == 1) return std::to_string(start + 1);
+        return std::to_string(count ? start + 1 : start) + "," + std::to_string(count);
+    };
+    auto emit = [](std::string &out, char mark, std::string_view line) {
+        out.append(1, mark).append(line);
+        if (line.empty() || line.back() != '\n') out += "\n\\ No newline at end of file\n";
+    };
+
+    std::string out;
+    for (size_t i = 0;;) {
+        size_t first = i;
+        while (first < ops.size() && ops[first] == DiffOp::Equal) first++;
+        if (first == ops.size()) break;
+
+        // Changes closer than twice the context share a hunk
+        size_t last = first;
+        for (size_t j = first; j < ops.size() && j - last <= 2 * kContext; j++) {
+            if (ops[j] != DiffOp::Equal) last = j;
+        }
+        size_t start = first > kContext ? first - kContext : 0;
+        size_t end = std::min(ops.size(), last + 1 + kContext);
+
+        if (out.empty()) out = "--- " + path + "\n+++ " + path + "\n";
+        out += "@@ -" + range(aLine[start], aLine[end] - aLine[start]) + " +" +
+               range(bLine[start], bLine[end] - bLine[start]) + " @@\n";
+        for (size_t j = start; j < end; j++) {
+            if (ops[j] == DiffOp::Insert) emit(out, '+', b[bLine[j]]);
+            else emit(out, ops[j] == DiffOp::Equal ? ' ' : '-', a[aLine[j]]);
+        }
+        i = end;
+    }
+    return out;
+}
+
+// Files for AI Commands
+// aiexplain and aifix send every chunk of every file in one batch and get the
+// answers back chunk by chunk, in file order
+struct ChunkedFile {
+    std::string path;
+    std::string code;
+    std::vector<SourceChunk> chunks;
+    std::vector<std::string> answers; // one per chunk
+    std::string error;                // first failed answer
+};
+
+std::string explain_prompt(const std::string &code) {
+    return "Explain the following code in detail:\n\n" + code;
+}
+
+std::string fix_prompt(const std::string &code) {
+    return "Fix errors and improve the following code:\n\n" + code +
+           "\n\nPlease provide only the corrected code without explanations.";
+}
+
+std::string explain_chunk_prompt(const ChunkedFile &file, size_t index) {
+    const SourceChunk &chunk = file.chunks[index];
+    if (file.chunks.size() == 1) return explain_prompt(chunk.text);
+    return "Explain the following code in detail. It is lines " + std::to_string(chunk.firstLine) + "-" +
+           std::to_string(chunk.lastLine) + " of " + file.path + ", which is too large to send at once:\n\n" +
+           chunk.text;
+}
+
+std::string fix_chunk_prompt(const ChunkedFile &file, size_t index) {
+    const SourceChunk &chunk = file.chunks[index];
+    if (file.chunks.size() == 1) return fix_prompt(chunk.text);
+    return "Fix errors and improve the following code. It is lines " + std::to_string(chunk.firstLine) + "-" +
+           std::to_string(chunk.lastLine) + " of " + file.path + ", which is too large to send at once:\n\n" +
+           chunk.text + "\n\nPlease provide only the corrected lines without explanations.";
+}
+
+// File arguments from tokens[1..] with glob patterns such as src/*.cpp
+// expanded; a pattern that matches nothing is kept as written
+std::vector<std::string> file_arguments(const Args &tokens) {
+    std::vector<std::string> files;
+    for (size_t i = 1; i < tokens.size(); i++) {
+        std::string pattern(tokens[i]);
+#ifndef _WIN32
+        glob_t matches;
+        if (pattern.find_first_of("*?[") != std::string::npos &&
+            glob(pattern.c_str(), GLOB_NOCHECK, nullptr, &matches) == 0) {
+            files.insert(files.end(), matches.gl_pathv, matches.gl_pathv + matches.gl_pathc);
+            globfree(&matches);
+            continue;
+        }
+#endif
+        files.push_back(pattern);
+    }
+    return files;
+}
+
+// Ask about every chunk of every file at once. Files that cannot be read are
+// reported and skipped; `done` gets each file, in order, once all its
+// chunks are answered.
+void ai_files_batch(const std::vector<std::string> &paths, bool rewrite,
+                    std::string (*make_prompt)(const ChunkedFile &file, size_t chunk),
+                    const std::function<void(const ChunkedFile &file)> &done) {
+    std::string model = variable_or("AI_MODEL", "llama3-70b-8192");
+    size_t budget = chunk_budget(model, rewrite);
+
+    std::vector<ChunkedFile> files;
+    for (const std::string &filename : paths) {
+        std::string code = read_file(filename);
+        if (code.empty()) {
+            show_error("Could not read file: " + filename);
+            continue;
+        }
+        std::vector<SourceChunk> chunks = chunk_source(code, budget);
+        files.push_back({filename, std::move(code), std::move(chunks), {}, {}});
+    }
+
+    std::vector<std::string> prompts;
+    std::vector<size_t> owner; // file of each prompt
+    for (size_t i = 0; i < files.size(); i++) {
+        for (size_t chunk = 0; chunk < files[i].chunks.size(); chunk++) {
+            prompts.push_back(make_prompt(files[i], chunk));
+            owner.push_back(i);
+        }
+    }
+    if (prompts.empty()) return;
+
+    std::cout << "Asking AI about " << files.size() << (files.size() == 1 ? " file" : " files");
+    if (prompts.size() > files.size()) std::cout << " in " << prompts.size() << " parts";
+    std::cout << "..." << std::endl;
+
+    call_groq_batch(prompts, model, [&](size_t index, const std::string &answer, bool ok) {
+        ChunkedFile &file = files[owner[index]];
+        file.answers.push_back(answer);
+        if (!ok && file.error.empty()) file.error = answer;
+        if (file.answers.size() == file.chunks.size()) done(file);
+    });
+}
+
+// The code inside the first ``` fence of an answer, or the whole answer
+std::string_view strip_code_fence(std::string_view answer) {
+    size_t open = answer.find("```");
+    if (open == std::string_view::npos) return answer;
+    size_t start = answer.find('\n', open);
+    if (start == std::string_view::npos) return answer;
+    start++;
+
+    size_t close = answer.find("```", start);
+    while (close != std::string_view::npos && answer[close - 1] != '\n') close = answer.find("```", close + 3);
+    return answer.substr(start, close == std::string_view::npos ? std::string_view::npos : close - start);
+}
+
+// The fixed file: the fixed chunks joined back together
+std::string merge_fixes(const ChunkedFile &file) {
+    std::string merged;
+    for (size_t i = 0; i < file.answers.size(); i++) {
+        merged.append(strip_code_fence(file.answers[i]));
+        bool newline = i + 1 < file.answers.size() || file.code.back() == '\n';
+        if (newline && !merged.empty() && merged.back() != '\n') merged += '\n';
+    }
+    return merged;
+}
+
+// AI Generate Command completion
+std::string ai_complete_command(const Args &tokens, const TokenSink &sink = nullptr) {
+    if (tokens.size() < 3) {
+        show_error("Usage: aicomplete <language> \"<partial code>\"");
+        return "";
+    }
+    
+    std::string language(tokens[1]);
+    std::string partial_code;
+    
+    // Combine all tokens after language into the partial code
+    for (size_t i = 2; i < tokens.size(); i++) {
+        partial_code.append(tokens[i]) += " ";
+    }
+    
+    std::string prompt = "Complete the following " + language + " code:\n\n" + partial_code + 
+                         "\n\nProvide only the completed code.";
+    
+    std::string model = variable_or("AI_MODEL", "llama3-70b-8192");
+    return call_groq_api(prompt, model, sink);
+}
+
+// Command History
+// Every session appends its commands to ~/.myshell/history, one per line.
+// The sidecar history.idx holds the offset of each line and how much of the
+// file it covers, so startup maps the file and only scans what other
+// sessions appended since; entries are views into the mapping. The index
+// file is also the lock that serializes writers. Past HISTORY_SIZE entries
+// (default 100000) the file is rewritten with duplicates removed.
+class History {
+public:
+    void load() {
+        if (variable_or("HISTORY", "on") == "off") return;
+        fs::path file = variable_or("HISTORY_FILE", (myshell_dir() / "history").string());
+        std::error_code error;
+        fs::create_directories(file.parent_path(), error);
+        path_ = file.string();
+        enabled_ = true;
+#ifndef _WIN32
+        int lock = lock_index();
+        if (lock < 0) return;
+        read_locked(lock);
+        size_t limit = history_limit();
+        if (entries_.size() > limit + limit / 4) {
+            compact_locked(lock, limit);
+            read_locked(lock);
+        }
+        close(lock); // releases the lock
+#else
+        std::ifstream in(path_, std::ios::binary);
+        std::string line;
+        while (std::getline(in, line)) {
+            added_.push_back(line);
+            entries_.push_back(added_.back());
+        }
+#endif
+    }
+
+    void add(const std::string &line) {
+        if (!enabled_ || line.find_first_not_of(" \t") == std::string::npos) return;
+        if (!entries_.empty() && entries_.back() == line) return; // repeated command
+        if (variable_or("HISTORY", "on") == "off") return;
+        added_.push_back(line);
+        entries_.push_back(added_.back());
+        std::string record = line + "\n";
+#ifndef _WIN32
+        int lock = lock_index();
+        if (lock < 0) return;
+        int fd = open(path_.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && write(fd, record.data(), record.size()) == static_cast<ssize_t>(record.size())) {
+            // Extend the index only if it covered the file up to this line
+            IndexHeader header;
+            if (read_header(lock, header) && header.inode == static_cast<uint64_t>(st.st_ino) &&
+                header.covered == static_cast<uint64_t>(st.st_size)) {
+                uint64_t offset = header.covered;
+                struct stat index;
+                if (fstat(lock, &index) == 0 && pwrite(lock, &offset, sizeof(offset), index.st_size) == sizeof(offset)) {
+                    header.covered += record.size();
+                    pwrite(lock, &header, sizeof(header), 0);
+                }
+            }
+        }
+        if (fd >= 0) close(fd);
+        close(lock);
+#else
+        std::ofstream(path_, std::ios::binary | std::ios::app) << record;
+#endif
+    }
+
+    void clear() {
+        entries_.clear();
+        added_.clear();
+        mapped_.reset();
+        if (!enabled_) return;
+#ifndef _WIN32
+        // Other sessions may have the file mapped, so it is replaced, not truncated
+        int lock = lock_index();
+        if (lock < 0) return;
+        replace_locked(lock, "");
+        close(lock);
+#else
+        std::ofstream(path_, std::ios::binary | std::ios::trunc);
+#endif
+    }
+
+    size_t size() const { return entries_.size(); }
+    std::string_view operator[](size_t i) const { return entries_[i]; }
+
+    // The newest entry before `before` that contains `query`, or npos
+    size_t search(std::string_view query, size_t before) const {
+        for (size_t i = std::min(before, entries_.size()); i-- > 0;) {
+            if (entries_[i].find(query) != std::string_view::npos) return i;
+        }
+        return std::string_view::npos;
+    }
+
+private:
+#ifndef _WIN32
+    struct IndexHeader {
+        char magic[8];
+        uint64_t inode;   // of the history file it describes
+        uint64_t covered; // bytes of the history file indexed so far
+    };
+    static constexpr char kIndexMagic[8] = {'m', 'y', 's', 'h', 'i', 'd', 'x', '1'};
+
+    int lock_index() {
+        int lock = open((path_ + ".idx").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (lock >= 0 && flock(lock, LOCK_EX) != 0) {
+            close(lock);
+            lock = -1;
+        }
+        return lock;
+    }
+
+    static bool read_header(int lock, IndexHeader &header) {
+        return pread(lock, &header, sizeof(header), 0) == sizeof(header) &&
+               std::memcmp(header.magic, kIndexMagic, sizeof(kIndexMagic)) == 0;
+    }
+
+    static size_t history_limit() {
+        long limit = std::atol(variable_or("HISTORY_SIZE", "100000").c_str());
+        return limit > 0 ? static_cast<size_t>(limit) : 100000;
+    }
+
+    // Map the file, take the offsets the index already has and scan the rest
+    void read_locked(int lock) {
+        entries_.clear();
+        added_.clear();
+        mapped_.reset();
+        int fd = open(path_.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0600);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0) close(fd);
+            return;
+        }
+        size_t size = static_cast<size_t>(st.st_size);
+        void* data = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        close(fd);
+        const char* text = data != MAP_FAILED ? static_cast<const char*>(data) : "";
+        if (data != MAP_FAILED) mapped_ = std::make_shared<MappedFile>(text, size);
+        else size = 0;
+
+        IndexHeader header;
+        std::vector<uint64_t> offsets;
+        struct stat index;
+        bool valid = read_header(lock, header) && header.inode == static_cast<uint64_t>(st.st_ino) &&
+                     header.covered <= size && fstat(lock, &index) == 0;
+        if (valid) {
+            offsets.resize((index.st_size - sizeof(header)) / sizeof(uint64_t));
+            ssize_t bytes = offsets.size() * sizeof(uint64_t);
+            valid = pread(lock, offsets.data(), bytes, sizeof(header)) == bytes &&
+                    (offsets.empty() || offsets.back() < header.covered);
+        }
+        if (!valid) {
+            offsets.clear();
+            std::memcpy(header.magic, kIndexMagic, sizeof(kIndexMagic));
+            header.inode = st.st_ino;
+            header.covered = 0;
+        }
+
+        size_t indexed = offsets.size();
+        size_t pos = header.covered;
+        while (pos < size) {
+            const void* newline = std::memchr(text + pos, '\n', size - pos);
+            if (!newline) break; // a line still being written
+            offsets.push_back(pos);
+            pos = static_cast<const char*>(newline) - text + 1;
+        }
+        if (!valid) {
+            if (ftruncate(lock, 0) != 0) return;
+            indexed = 0;
+        }
+        if (offsets.size() > indexed || !valid) {
+            header.covered = pos;
+            pwrite(lock, offsets.data() + indexed, (offsets.size() - indexed) * sizeof(uint64_t),
+                   sizeof(header) + indexed * sizeof(uint64_t));
+            pwrite(lock, &header, sizeof(header), 0);
+        }
+
+        entries_.reserve(offsets.size());
+        for (size_t i = 0; i < offsets.size(); i++) {
+            size_t end = (i + 1 < offsets.size() ? offsets[i + 1] : pos) - 1;
+            entries_.emplace_back(text + offsets[i], end - offsets[i]);
+        }
+    }
+
+    // Keep the newest `limit` distinct commands, replacing the file at once
+    void compact_locked(int lock, size_t limit) {
+        std::unordered_set<std::string_view> seen;
+        std::vector<std::string_view> kept;
+        for (size_t i = entries_.size(); i-- > 0 && kept.size() < limit;) {
+            if (seen.insert(entries_[i]).second) kept.push_back(entries_[i]);
+        }
+        std::string text;
+        for (size_t i = kept.size(); i-- > 0;) {
+            text.append(kept[i].data(), kept[i].size());
+            text += '\n';
+        }
+        replace_locked(lock, text);
+    }
+
+    // Write `text` to a new file and rename it over the history. Sessions
+    // that mapped the old file keep reading it; the index is rebuilt.
+    void replace_locked(int lock, const std::string &text) {
+        std::string temp = path_ + ".tmp";
+        int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        bool written = fd >= 0 && write(fd, text.data(), text.size()) == static_cast<ssize_t>(text.size());
+        if (fd >= 0) close(fd);
+        if (written && rename(temp.c_str(), path_.c_str()) == 0) {
+            if (ftruncate(lock, 0) != 0) show_error("Cannot reset history index");
+        } else {
+            unlink(temp.c_str());
+            show_error("Cannot rewrite history file " + path_);
+        }
+    }
+#endif
+
+    bool enabled_ = false;
+    std::string path_;
+    std::shared_ptr<MappedFile> mapped_; // holds the entries read at startup
+    std::deque<std::string> added_;      // entries added since
+    std::vector<std::string_view> entries_;
+};
+
+History command_history;
+
+// Replace a leading `!!`, `!n`, `!-n` or `!prefix` with that history entry.
+// Returns false, after reporting it, if there is no such entry.
+bool expand_history(std::string &line) {
+    if (line.size() < 2 || line[0] != '!') return true;
+    size_t end = line.find_first_of(" \t");
+    std::string_view event = std::string_view(line).substr(1, end == std::string::npos ? end : end - 1);
+    size_t index = std::string_view::npos;
+    if (event == "!") {
+        if (command_history.size() > 0) index = command_history.size() - 1;
+    } else if (std::isdigit(static_cast<unsigned char>(event[0])) ||
+               (event[0] == '-' && event.size() > 1 && std::isdigit(static_cast<unsigned char>(event[1])))) {
+        long n = std::atol(std::string(event).c_str());
+        if (n > 0 && static_cast<size_t>(n) <= command_history.size()) index = n - 1;
+        if (n < 0 && static_cast<size_t>(-n) <= command_history.size()) index = command_history.size() + n;
+    } else {
+        for (size_t i = command_history.size(); i-- > 0;) {
+            if (command_history[i].substr(0, event.size()) == event) {
+                index = i;
+                break;
+            }
+        }
+    }
+    if (index == std::string_view::npos) {
+        show_error("No such history entry: !" + std::string(event));
+        return false;
+    }
+    line = std::string(command_history[index]) + (end == std::string::npos ? "" : line.substr(end));
+    std::cout << line << std::endl;
+    return true;
+}
+
+#ifndef _WIN32
+// Line Editor
+// Used when both ends are a terminal: editing keys, Up/Down through the
+// history and Ctrl-R incremental reverse search, which skips repeats of
+// matches already shown. Anything else is read with std::getline.
+class LineEditor {
+public:
+    // Returns false at end of input
+    bool read_line(const std::string &prompt, std::string &line) {
+        std::cout.flush();
+        termios saved;
+        if (tcgetattr(STDIN_FILENO, &saved) != 0) return fallback(prompt, line);
+        termios raw = saved;
+        raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+        raw.c_iflag &= ~(IXON | ICRNL);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+        bool ok = edit(prompt, line);
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved);
+        return ok;
+    }
+
+private:
+    static bool fallback(const std::string &prompt, std::string &line) {
+        std::cout << prompt;
+        return static_cast<bool>(std::getline(std::cin, line));
+    }
+
+    static int read_key() {
+        unsigned char c;
+        return read(STDIN_FILENO, &c, 1) == 1 ? c : -1;
+    }
+
+    static void put(const std::string &text) {
+        for (size_t done = 0; done < text.size();) {
+            ssize_t n = write(STDOUT_FILENO, text.data() + done, text.size() - done);
+            if (n <= 0) return;
+            done += n;
+        }
+    }
+
+    void redraw(const std::string &prompt) {
+        std::string out = "\r" + prompt + buffer_ + "\033[K";
+        if (cursor_ < buffer_.size()) out += "\033[" + std::to_string(buffer_.size() - cursor_) + "D";
+        put(out);
+    }
+
+    // Up/Down: step through the history, keeping the line being typed
+    void recall(size_t index) {
+        if (position_ == command_history.size()) pending_ = buffer_;
+        position_ = index;
+        buffer_ = position_ == command_history.size() ? pending_ : std::string(command_history[position_]);
+        cursor_ = buffer_.size();
+    }
+
+    bool edit(const std::string &prompt, std::string &line) {
+        buffer_.clear();
+        cursor_ = 0;
+        position_ = command_history.size();
+        redraw(prompt);
+        for (;;) {
+            int key = read_key();
+            if (key == 18) key = reverse_search(prompt); // Ctrl-R
+            switch (key) {
+            case -1:
+                return false;
+            case '\r': case '\n':
+                put("\n");
+                line = buffer_;
+                return true;
+            case 3: // Ctrl-C drops the line
+                put("^C\n");
+                line.clear();
+                return true;
+            case 4: // Ctrl-D: end of input on an empty line
+                if (buffer_.empty()) {
+                    put("\n");
+                    return false;
+                }
+                if (cursor_ < buffer_.size()) buffer_.erase(cursor_, 1);
+                break;
+            case 127: case 8:
+                if (cursor_ > 0) buffer_.erase(--cursor_, 1);
+                break;
+            case 1: cursor_ = 0; break;                  // Ctrl-A
+            case 5: cursor_ = buffer_.size(); break;     // Ctrl-E
+            case 11: buffer_.erase(cursor_); break;      // Ctrl-K
+            case 21:                                     // Ctrl-U
+                buffer_.erase(0, cursor_);
+                cursor_ = 0;
+                break;
+            case 12: put("\033[H\033[2J"); break;        // Ctrl-L
+            case 27:
+                escape_sequence();
+                break;
+            default:
+                if (key >= 32 || key == '\t') buffer_.insert(cursor_++, 1, static_cast<char>(key));
+                break;
+            }
+            redraw(prompt);
+        }
+    }
+
+    void escape_sequence() {
+        int first = read_key();
+        if (first != '[' && first != 'O') return;
+        int code = read_key();
+        if (code >= '0' && code <= '9') {
+            if (read_key() != '~') return;
+            if (code == '3' && cursor_ < buffer_.size()) buffer_.erase(cursor_, 1); // Delete
+            if (code == '1' || code == '7') cursor_ = 0;                           // Home
+            if (code == '4' || code == '8') cursor_ = buffer_.size();              // End
+            return;
+        }
+        switch (code) {
+        case 'A': if (position_ > 0) recall(position_ - 1); break;
+        case 'B': if (position_ < command_history.size()) recall(position_ + 1); break;
+        case 'C': if (cursor_ < buffer_.size()) cursor_++; break;
+        case 'D': if (cursor_ > 0) cursor_--; break;
+        case 'H': cursor_ = 0; break;
+        case 'F': cursor_ = buffer_.size(); break;
+        }
+    }
+
+    // Returns the key that ended the search, to be handled by the editor with
+    // the match in the buffer; Ctrl-G restores the line as it was
+    int reverse_search(const std::string &prompt) {
+        std::string original = buffer_;
+        std::string query;
+        size_t match = command_history.size();
+        std::unordered_set<std::string_view> shown;
+        auto find = [&](size_t before) {
+            for (size_t i = command_history.search(query, before); i != std::string_view::npos; i = command_history.search(query, i)) {
+                if (shown.insert(command_history[i]).second) return i;
+            }
+            return std::string_view::npos;
+        };
+        bool failed = false;
+        for (;;) {
+            std::string status = failed ? "(failed reverse-i-search)`" : "(reverse-i-search)`";
+            std::string shownLine = match < command_history.size() ? std::string(command_history[match]) : "";
+            put("\r" + status + query + "': " + shownLine + "\033[K");
+
+            int key = read_key();
+            if (key == 18) { // Ctrl-R: the next older match
+                size_t next = query.empty() ? std::string_view::npos : find(match);
+                failed = next == std::string_view::npos;
+                if (!failed) match = next;
+                continue;
+            }
+            if (key == 127 || key == 8 || (key >= 32 && key < 127)) {
+                // A longer query can only match the current line or older ones;
+                // a shorter one starts again from the newest entry
+                if (key == 127 || key == 8) {
+                    if (!query.empty()) query.pop_back();
+                    match = command_history.size();
+                } else {
+                    query += static_cast<char>(key);
+                    if (match < command_history.size()) match++;
+                }
+                shown.clear();
+                size_t next = query.empty() ? std::string_view::npos : find(match);
+                failed = !query.empty() && next == std::string_view::npos;
+                if (next != std::string_view::npos) match = next;
+                else if (query.empty()) match = command_history.size();
+                continue;
+            }
+            if (key == 7) { // Ctrl-G
+                buffer_ = original;
+                cursor_ = buffer_.size();
+                put("\r" + prompt + "\033[K");
+                return 0;
+            }
+            if (match < command_history.size()) {
+                buffer_ = std::string(command_history[match]);
+                position_ = match;
+            }
+            cursor_ = buffer_.size();
+            put("\r" + prompt + "\033[K");
+            return key;
+        }
+    }
+
+    std::string buffer_;
+    size_t cursor_ = 0;
+    size_t position_ = 0;  // history entry being shown; size() for the new line
+    std::string pending_;  // the new line while browsing the history
+};
+#endif
+
+// Read one line typed at the prompt. `prompt` is printed first.
+bool read_command_line(const std::string &prompt, std::string &line) {
+#ifndef _WIN32
+    static const bool interactive = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+    if (interactive) {
+        static LineEditor editor;
+        return editor.read_line(prompt, line);
+    }
+#endif
+    std::cout << prompt;
+    return static_cast<bool>(std::getline(std::cin, line));
+}
+
+// Builtin Commands
+// Every builtin is a handler function registered in builtin_commands below,
+// together with its arity and usage text. Dispatch, argument validation,
+// `help` and the `timings` counters are all driven by that one table.
+using BuiltinHandler = void (*)(const Args &tokens, std::string_view line);
+
+void run_script(const std::string &filename);
+void import_script(const std::string &filename);
+
+bool exit_requested = false;
+int script_depth = 0; // scripts being run by `run` or `import`
+
+// Join tokens[first..] with single spaces
+std::string join_tokens(const Args &tokens, size_t first) {
+    std::string joined;
+    for (size_t i = first; i < tokens.size(); i++) {
+        joined.append(tokens[i]) += " ";
+    }
+    if (!joined.empty()) joined.pop_back(); // Remove trailing space
+    return joined;
+}
+
+void builtin_echo(const Args &tokens, std::string_view) {
+    for (size_t i = 1; i < tokens.size(); i++) {
+        std::cout << tokens[i] << " ";
+    }
+    std::cout << std::endl;
+}
+
+void builtin_set(const Args &tokens, std::string_view) {
+    std::string name(tokens[1]);
+    std::string value = join_tokens(tokens, 2);
+    assign_variable(name, value);
+    
+    // Logger settings take effect immediately
+    if (tokens[1] == "LOG_LEVEL") {
+        LogLevel level;
+        if (parse_log_level(value, level)) logger.set_level(level);
+        else show_error("Unknown log level: " + value + " (use debug, info, warning or error)");
+    } else if (tokens[1] == "LOG_MAX_SIZE") {
+        try {
+            logger.set_max_size(std::stoull(value));
+        } catch (...) {
+            show_error("Invalid log size: " + value);
+        }
+    }
+    
+    if (tokens[1] == "AI_BACKEND" && value != "http" && value != "stub") {
+        show_error("Unknown AI backend: " + value + " (use http or stub)");
+    }
+
+    // If setting GROQ_API_KEY, initialize API
+    if (tokens[1] == "GROQ_API_KEY") {
+        groq_api_key = value;
+        std::cout << "\033[1;32mGroq AI API key set. AI features are now enabled.\033[0m" << std::endl;
+    }
+    
+    std::cout << "Variable " << tokens[1] << " set to: " << value << std::endl;
+}
+
+void builtin_calc(const Args &tokens, std::string_view) {
+    std::string expr = join_tokens(tokens, 1);
+    CalcValue result;
+    if (!calculate(expr, result)) return;
+    std::string formatted = format_number(result);
+    assign_variable("RESULT", formatted);
+    std::cout << expr << " = " << formatted << std::endl;
+}
+
+void builtin_read(const Args &tokens, std::string_view) {
+    assign_variable(std::string(tokens[1]), load_file(std::string(tokens[2])));
+    std::cout << "Read file content into variable " << tokens[1] << std::endl;
+}
+
+void builtin_capture(const Args &tokens, std::string_view line) {
+    release_files();
+    std::string output = execute_command(rest_of_line(line, 2));
+    if (!output.empty() && output.back() == '\n') output.pop_back();
+    assign_variable(std::string(tokens[1]), std::move(output));
+    std::cout << "Captured command output into variable " << tokens[1] << std::endl;
+}
+
+void builtin_write(const Args &tokens, std::string_view) {
+    write_file(std::string(tokens[1]), join_tokens(tokens, 2));
+}
+
+void builtin_append(const Args &tokens, std::string_view) {
+    append_file(std::string(tokens[1]), join_tokens(tokens, 2));
+}
+
+void builtin_cd(const Args &tokens, std::string_view) {
+    change_directory(tokens);
+}
+
+void builtin_ls(const Args &tokens, std::string_view) {
+    ListOptions options;
+    std::vector<std::string> paths;
+    for (size_t i = 1; i < tokens.size(); i++) {
+        std::string_view token = tokens[i];
+        if (token.size() < 2 || token[0] != '-') {
+            paths.emplace_back(token);
+            continue;
+        }
+        for (char flag : token.substr(1)) {
+            switch (flag) {
+                case 'a': options.all = true; break;
+                case 'l': options.longFormat = true; break;
+                case 'R': options.recursive = true; break;
+                case 'r': options.reverse = true; break;
+                case 'S': case 't': options.sort = flag; break;
+                default:
+                    show_error(std::string("Unknown ls option: -") + flag);
+                    return;
+            }
+        }
+    }
+    if (paths.empty()) paths.emplace_back(".");
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (i > 0) std::cout << "\n";
+        list_directory(paths[i], options);
+    }
+}
+
+void builtin_mkdir(const Args &tokens, std::string_view) {
+    create_directory(std::string(tokens[1]));
+}
+
+void builtin_rm(const Args &tokens, std::string_view) {
+    // Directories are always removed with their contents; -r is accepted for
+    // familiarity and -f ignores paths that do not exist
+    bool force = false;
+    std::vector<std::string> paths;
+    for (size_t i = 1; i < tokens.size(); i++) {
+        std::string_view token = tokens[i];
+        if (token.size() < 2 || token[0] != '-') {
+            paths.emplace_back(token);
+            continue;
+        }
+        for (char flag : token.substr(1)) {
+            if (flag == 'f') {
+                force = true;
+            } else if (flag != 'r' && flag != 'R') {
+                show_error(std::string("Unknown rm option: -") + flag);
+                return;
+            }
+        }
+    }
+    if (paths.empty()) {
+        show_error("Usage: rm [-rf] <path>...");
+        return;
+    }
+    close_open_files();
+    for (const std::string &path : paths) remove_file_or_directory(path, force);
+}
+
+// Whether any flag in `tokens` uses a letter outside `supported`
+bool has_unsupported_flag(const Args &tokens, std::string_view supported) {
+    for (size_t i = 1; i < tokens.size(); i++) {
+        std::string_view token = tokens[i];
+        if (token.size() >= 2 && token[0] == '-' && token.substr(1).find_first_not_of(supported) != std::string_view::npos) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// cp, mv and grep stand in for the system commands but only know their
+// common flags. Given any other flag, the command runs externally as written.
+void run_system_command(std::string_view line) {
+    release_files();
+    last_status = run_external_command(std::string(line));
+}
+
+// `cp`/`mv` arguments: sources (globs expanded) and a destination, which
+// must be a directory when there are several sources
+bool copy_arguments(const Args &tokens, const char* usage, bool* recursive,
+                    std::vector<std::string> &sources, std::string &dest, bool &intoDirectory) {
+    Args operands{tokens[0]};
+    for (size_t i = 1; i < tokens.size(); i++) {
+        std::string_view token = tokens[i];
+        if (token.size() < 2 || token[0] != '-') {
+            operands.push_back(token);
+            continue;
+        }
+        for (char flag : token.substr(1)) {
+            if (recursive && (flag == 'r' || flag == 'R')) {
+                *recursive = true;
+            } else {
+                show_error(std::string("Unknown option: -") + flag);
+                return false;
+            }
+        }
+    }
+    if (operands.size() < 3) {
+        show_error(std::string("Usage: ") + usage);
+        return false;
+    }
+    dest = std::string(operands.back());
+    operands.pop_back();
+    sources = file_arguments(operands);
+    std::error_code error;
+    intoDirectory = fs::is_directory(dest, error);
+    if (sources.size() > 1 && !intoDirectory) {
+        show_error("Not a directory: " + dest);
+        return false;
+    }
+    return true;
+}
+
+void builtin_cp(const Args &tokens, std::string_view line) {
+    if (has_unsupported_flag(tokens, "rR")) {
+        run_system_command(line);
+        return;
+    }
+    bool recursive = false;
+    std::vector<std::string> sources;
+    std::string dest;
+    bool intoDirectory;
+    if (!copy_arguments(tokens, "cp [-r] <source>... <destination>", &recursive, sources, dest, intoDirectory)) return;
+    close_open_files();
+    CopyResult result;
+    for (const std::string &source : sources) {
+        copy_path(source, intoDirectory ? join_path(dest, base_name(source)) : dest, recursive, result);
+    }
+    std::cout << "Copied " << result.files << (result.files == 1 ? " file" : " files") << " to " << dest << std::endl;
+    result.report();
+}
+
+void builtin_mv(const Args &tokens, std::string_view line) {
+    if (has_unsupported_flag(tokens, "")) {
+        run_system_command(line);
+        return;
+    }
+    std::vector<std::string> sources;
+    std::string dest;
+    bool intoDirectory;
+    if (!copy_arguments(tokens, "mv <source>... <destination>", nullptr, sources, dest, intoDirectory)) return;
+    close_open_files();
+    CopyResult result;
+    for (const std::string &source : sources) {
+        std::string target = intoDirectory ? join_path(dest, base_name(source)) : dest;
+        size_t failures = result.failures;
+        move_path(source, target, result);
+        if (result.failures == failures) std::cout << "Moved " << source << " to " << target << std::endl;
+    }
+    result.report();
+}
+
+void builtin_grep(const Args &tokens, std::string_view line) {
+    if (has_unsupported_flag(tokens, "icnlvFrRo")) {
+        run_system_command(line);
+        return;
+    }
+    GrepOptions options;
+    Args operands{tokens[0]};
+    for (size_t i = 1; i < tokens.size(); i++) {
+        std::string_view token = tokens[i];
+        if (token.size() < 2 || token[0] != '-') {
+            operands.push_back(token);
+            continue;
+        }
+        for (char flag : token.substr(1)) {
+            switch (flag) {
+                case 'i': options.ignoreCase = true; break;
+                case 'n': options.lineNumbers = true; break;
+                case 'c': options.count = true; break;
+                case 'l': options.filesOnly = true; break;
+                case 'v': options.invert = true; break;
+                case 'F': options.fixed = true; break;
+                case 'r': case 'R': options.recursive = true; break;
+                case 'o':
+                    if (i + 1 == tokens.size()) {
+                        show_error("grep -o needs a variable name");
+                        return;
+                    }
+                    options.variable = std::string(tokens[++i]);
+                    break;
+                default:
+                    show_error(std::string("Unknown grep option: -") + flag);
+                    return;
+            }
+        }
+    }
+    if (operands.size() < 3) {
+        show_error("Usage: grep [-icnlvFr] [-o var] <pattern> <file>...");
+        return;
+    }
+    std::string pattern(operands[1]);
+    operands.erase(operands.begin() + 1);
+    std::vector<std::string> files = file_arguments(operands);
+    if (options.recursive) {
+        std::vector<std::string> roots = std::move(files);
+        files.clear();
+        for (const std::string &root : roots) grep_paths(root, files);
+    }
+    options.showNames = files.size() > 1 || options.recursive;
+
+    std::unique_ptr<GrepMatcher> matcher;
+    try {
+        matcher = std::make_unique<GrepMatcher>(pattern, options);
+    } catch (const std::regex_error &e) {
+        show_error("Invalid pattern " + pattern + ": " + e.what());
+        return;
+    }
+    close_open_files();
+
+    // Batches keep the pool busy without a task per file
+    constexpr size_t kGrepBatch = 32;
+    std::vector<GrepResult> results(files.size());
+    std::vector<std::future<void>> batches;
+    for (size_t first = 0; first < files.size(); first += kGrepBatch) {
+        size_t last = std::min(first + kGrepBatch, files.size());
+        auto search = [&, first, last] {
+            for (size_t i = first; i < last; i++) grep_file(*matcher, files[i], results[i]);
+        };
+        if (files.size() == 1) {
+            search();
+        } else {
+            batches.push_back(worker_pool().submit(search));
+        }
+    }
+
+    std::string stored;
+    size_t matches = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        if (i % kGrepBatch == 0 && !batches.empty()) batches[i / kGrepBatch].wait();
+        GrepResult &result = results[i];
+        if (!result.error.empty()) {
+            std::cout.flush();
+            show_error(result.error);
+            continue;
+        }
+        matches += result.matches;
+        if (!options.variable.empty()) {
+            stored += result.output;
+        } else if (!result.output.empty()) {
+            std::cout.write(result.output.data(), static_cast<std::streamsize>(result.output.size()));
+        }
+        std::string().swap(result.output);
+    }
+    std::cout.flush();
+
+    if (!options.variable.empty()) {
+        if (!stored.empty() && stored.back() == '\n') stored.pop_back();
+        assign_variable(options.variable, std::move(stored));
+        std::cout << "Stored " << matches << (matches == 1 ? " match" : " matches") << " in variable " << options.variable << std::endl;
+    }
+    if (matches == 0 && last_status == 0) last_status = 1; // like grep: nothing found
+}
+
+void builtin_history(const Args &tokens, std::string_view) {
+    if (tokens.size() > 1 && tokens[1] == "-c") {
+        command_history.clear();
+        return;
+    }
+    size_t count = command_history.size();
+    if (tokens.size() > 1) {
+        long n = std::atol(std::string(tokens[1]).c_str());
+        if (n <= 0) {
+            show_error("Usage: history [count|-c]");
+            return;
+        }
+        count = std::min(count, static_cast<size_t>(n));
+    }
+    std::string out;
+    char number[24];
+    for (size_t i = command_history.size() - count; i < command_history.size(); i++) {
+        int length = std::snprintf(number, sizeof(number), "%5zu  ", i + 1);
+        out.append(number, length).append(command_history[i]) += '\n';
+    }
+    std::cout.write(out.data(), static_cast<std::streamsize>(out.size()));
+}
+
+void builtin_import(const Args &tokens, std::string_view) {
+    import_script(std::string(tokens[1]));
+}
+
+void builtin_run(const Args &tokens, std::string_view) {
+    run_script(std::string(tokens[1]));
+}
+
+void builtin_sleep(const Args &tokens, std::string_view) {
+    try {
+        int ms = std::stoi(std::string(tokens[1]));
+        std::cout << "Sleeping for " << ms << "ms..." << std::endl;
+        std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    } catch (...) {
+        show_error("Invalid sleep time: " + std::string(tokens[1]));
+    }
+}
+
+void builtin_local(const Args &tokens, std::string_view) {
+    std::string value = join_tokens(tokens, 2);
+    if (call_frames.empty()) variables[std::string(tokens[1])] = value;
+    else call_frames.back()[std::string(tokens[1])] = value;
+}
+
+bool call_function(const Args &args);
+
+void builtin_call(const Args &tokens, std::string_view) {
+    if (!call_function(Args(tokens.begin() + 1, tokens.end()))) {
+        show_error("Unknown function: " + std::string(tokens[1]));
+    }
+}
+
+// Blocks are handled by the script compiler; this only runs when a keyword
+// appears where a command is expected, e.g. as the value of a variable
+void builtin_block_keyword(const Args &tokens, std::string_view) {
+    show_error(std::string(tokens[0]) + " must start a line in a script or at the prompt");
+}
+
+void builtin_sync(const Args &, std::string_view) {
+    sync_open_files();
+}
+
+// Job Control
+#ifdef _WIN32
+void builtin_jobs(const Args &, std::string_view) {
+    show_error("Background jobs are not supported on Windows");
+}
+
+void builtin_wait(const Args &tokens, std::string_view line) { builtin_jobs(tokens, line); }
+void builtin_fg(const Args &tokens, std::string_view line) { builtin_jobs(tokens, line); }
+void builtin_kill(const Args &tokens, std::string_view line) { builtin_jobs(tokens, line); }
+#else
+void builtin_jobs(const Args &, std::string_view) {
+    for (Job &job : jobs) {
+        update_job(job, false);
+        std::cout << "[" << job.id << "] " << job_state(job) << "\t" << job.command << std::endl;
+    }
+    jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [](const Job &job) { return job.pids.empty(); }), jobs.end());
+}
+
+void builtin_wait(const Args &tokens, std::string_view) {
+    if (tokens.size() == 1) {
+        while (!jobs.empty()) wait_job(jobs.begin());
+        return;
+    }
+    for (size_t i = 1; i < tokens.size(); i++) {
+        auto job = find_job(tokens[i]);
+        if (job == jobs.end()) {
+            show_error("No such job: " + std::string(tokens[i]));
+            continue;
+        }
+        last_status = wait_job(job);
+    }
+}
+
+// Without terminal job control, bringing a job to the foreground means
+// waiting for it
+void builtin_fg(const Args &tokens, std::string_view) {
+    auto job = find_job(tokens.size() > 1 ? tokens[1] : std::string_view());
+    if (job == jobs.end()) {
+        show_error(tokens.size() > 1 ? "No such job: " + std::string(tokens[1]) : "No current job");
+        return;
+    }
+    std::cout << job->command << std::endl;
+    last_status = wait_job(job);
+}
+
+int parse_signal(std::string_view name) {
+    static const std::pair<std::string_view, int> signals[] = {
+        {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL}, {"TERM", SIGTERM},
+        {"STOP", SIGSTOP}, {"CONT", SIGCONT}, {"USR1", SIGUSR1}, {"USR2", SIGUSR2},
+    };
+    if (name.substr(0, 3) == "SIG") name.remove_prefix(3);
+    for (const auto &signal : signals) {
+        if (signal.first == name) return signal.second;
+    }
+    int number = std::atoi(std::string(name).c_str());
+    return number > 0 ? number : -1;
+}
+
+// kill [-SIGNAL] <%job|pid>...
+void builtin_kill(const Args &tokens, std::string_view) {
+    int signal = SIGTERM;
+    size_t i = 1;
+    if (tokens[1].size() > 1 && tokens[1][0] == '-') {
+        signal = parse_signal(tokens[1].substr(1));
+        if (signal < 0) {
+            show_error("Unknown signal: " + std::string(tokens[1]));
+            return;
+        }
+        i++;
+    }
+    if (i == tokens.size()) {
+        show_error("Usage: kill [-signal] <%job|pid>...");
+        return;
+    }
+
+    for (; i < tokens.size(); i++) {
+        std::string target(tokens[i]);
+        if (target[0] == '%') {
+            auto job = find_job(target);
+            if (job == jobs.end()) {
+                show_error("No such job: " + target);
+                continue;
+            }
+            for (pid_t pid : job->pids) ::kill(pid, signal);
+        } else {
+            pid_t pid = std::atoi(target.c_str());
+            if (pid <= 0 || ::kill(pid, signal) != 0) show_error("Cannot signal " + target);
+        }
+    }
+}
+#endif
+
+// Inside a script started with `run` or `import` only that script ends
+void builtin_exit(const Args &, std::string_view) {
+    if (script_depth == 0) std::cout << "Exiting MyShell. Goodbye!" << std::endl;
+    exit_requested = true;
+}
+
+void builtin_help(const Args &tokens, std::string_view line);
+void builtin_timings(const Args &tokens, std::string_view line);
+
+// AI Commands
+void builtin_ai(const Args &tokens, std::string_view) {
+    // `ai <prompt> &` runs in the background
+    if (tokens.size() > 2 && tokens.back() == "&") {
+        start_async_ai(join_tokens(Args(tokens.begin(), tokens.end() - 1), 1), "");
+        return;
+    }
+    StreamPrinter printer("\033[1;36m");
+    printer.finish(ai_command(tokens, printer.sink()));
+}
+
+void builtin_aicode(const Args &tokens, std::string_view) {
+    StreamPrinter printer("\033[1;32m");
+    std::string code = ai_code_command(tokens, printer.sink());
+    printer.finish(code);
+    
+    // Ask user if they want to save the code to a file
+    std::cout << "Do you want to save this code to a file? (y/n): ";
+    std::string answer;
+    std::getline(std::cin, answer);
+    
+    if (answer == "y" || answer == "Y") {
+        std::cout << "Enter filename: ";
+        std::string filename;
+        std::getline(std::cin, filename);
+        write_file(filename, code);
+    }
+}
+
+// Files too large for one request are explained in parts, and several files
+// are asked about concurrently; answers print in file order
+void builtin_aiexplain(const Args &tokens, std::string_view) {
+    std::vector<std::string> files = file_arguments(tokens);
+    std::string model = variable_or("AI_MODEL", "llama3-70b-8192");
+
+    // A single file that fits in one request streams its answer
+    if (files.size() == 1) {
+        std::string code = read_file(files[0]);
+        if (code.empty()) {
+            show_error("Could not read file: " + files[0]);
+            return;
+        }
+        if (estimate_tokens(code) <= chunk_budget(model, false)) {
+            StreamPrinter printer("\033[1;36m");
+            printer.finish(call_groq_api(explain_prompt(code), model, printer.sink()));
+            return;
+        }
+    }
+
+    ai_files_batch(files, false, explain_chunk_prompt, [](const ChunkedFile &file) {
+        std::cout << "\n\033[1;33m==> " << file.path << " <==\033[0m\n";
+        for (size_t i = 0; i < file.chunks.size(); i++) {
+            if (file.chunks.size() > 1) {
+                std::cout << "\033[1;33m-- lines " << file.chunks[i].firstLine << "-" << file.chunks[i].lastLine
+                          << " --\033[0m\n";
+            }
+            std::cout << "\033[1;36m" << file.answers[i] << "\033[0m\n\n";
+        }
+        std::cout << std::flush;
+    });
+}
+
+void print_diff(const std::string &diff) {
+    for (std::string_view line : split_lines(diff)) {
+        const char *color = "";
+        if (line.substr(0, 2) == "@@") color = "\033[1;36m";
+        else if (line.substr(0, 3) == "+++" || line.substr(0, 3) == "---") color = "\033[1m";
+        else if (line[0] == '+') color = "\033[32m";
+        else if (line[0] == '-') color = "\033[31m";
+        std::cout << color << line.substr(0, line.size() - 1) << (*color ? "\033[0m\n" : "\n");
+    }
+    std::cout << std::flush;
+}
+
+// Ask user if they want to apply the fix
+void offer_fix(const std::string &filename, const std::string &fixed_code) {
+    std::cout << "Do you want to apply these changes to " << filename << "? (y/n): ";
+    std::string answer;
+    std::getline(std::cin, answer);
+    
+    if (answer == "y" || answer == "Y") {
+        write_file(filename, fixed_code);
+        std::cout << "File " << filename << " updated with fixed code." << std::endl;
+    }
+}
+
+// Fixes are shown as a unified diff against the file. Large files are fixed
+// chunk by chunk and several files concurrently; the changes are offered
+// once every answer is in, so no transfer waits on the user.
+void builtin_aifix(const Args &tokens, std::string_view) {
+    std::vector<std::pair<std::string, std::string>> fixes;
+    ai_files_batch(file_arguments(tokens), true, fix_chunk_prompt, [&](const ChunkedFile &file) {
+        std::cout << "\n\033[1;33m==> " << file.path << " <==\033[0m\n";
+        if (!file.error.empty()) {
+            std::cout << "\033[1;31m" << file.error << "\033[0m\n" << std::endl;
+            return;
+        }
+        std::string fixed = merge_fixes(file);
+        std::string diff = unified_diff(file.code, fixed, file.path);
+        if (diff.empty()) {
+            std::cout << "No changes suggested" << std::endl;
+            return;
+        }
+        print_diff(diff);
+        fixes.emplace_back(file.path, std::move(fixed));
+    });
+    if (ai_interrupted) return;
+    for (const auto &fix : fixes) offer_fix(fix.first, fix.second);
+}
+
+void builtin_aicomplete(const Args &tokens, std::string_view) {
+    StreamPrinter printer("\033[1;32m");
+    printer.finish(ai_complete_command(tokens, printer.sink()));
+}
+
+// aiasync [-o var] <prompt>
+void builtin_aiasync(const Args &tokens, std::string_view) {
+    size_t first = 1;
+    std::string variable;
+    if (tokens[1] == "-o") {
+        if (tokens.size() < 4) {
+            show_error("Usage: aiasync [-o var] <prompt>");
+            return;
+        }
+        variable = tokens[2];
+        first = 3;
+    }
+    start_async_ai(join_tokens(tokens, first), variable);
+}
+
+// aiwait [id...]: wait for background AI requests and deliver their answers
+void builtin_aiwait(const Args &tokens, std::string_view) {
+    std::vector<std::shared_ptr<AsyncAiRequest>> waiting;
+    if (tokens.size() == 1) waiting = ai_requests;
+    for (size_t i = 1; i < tokens.size(); i++) {
+        int id = std::atoi(std::string(tokens[i]).c_str());
+        auto it = std::find_if(ai_requests.begin(), ai_requests.end(), [id](const auto &r) { return r->id == id; });
+        if (it == ai_requests.end()) show_error("No such AI request: " + std::string(tokens[i]));
+        else waiting.push_back(*it);
+    }
+
+    auto allFinished = [&] {
+        return std::all_of(waiting.begin(), waiting.end(), [](const auto &r) { return r->finished.load(); });
+    };
+    InterruptGuard interrupt;
+    while (!allFinished() && !ai_interrupted) ai_event_loop().wait(std::chrono::milliseconds(100), allFinished);
+    if (ai_interrupted) {
+        show_error("Stopped waiting; the requests keep running");
+        return;
+    }
+
+    bool ok = true;
+    for (const auto &request : waiting) {
+        ok = deliver_async_ai(*request) && ok;
+        ai_requests.erase(std::find(ai_requests.begin(), ai_requests.end(), request));
+    }
+    if (!ok) last_status = 1;
+}
+
+void builtin_aireset(const Args &, std::string_view) {
+    conversation.reset();
+    std::cout << "AI conversation cleared" << std::endl;
+}
+
+void builtin_aihistory(const Args &, std::string_view) {
+    const std::deque<Conversation::Message> &messages = conversation.messages();
+    if (messages.empty()) {
+        std::cout << "No AI conversation yet" << std::endl;
+        return;
+    }
+    for (const Conversation::Message &message : messages) {
+        json parsed = json::parse(message.json);
+        bool user = parsed["role"] == "user";
+        std::cout << (user ? "\033[1;33mYou: \033[0m" : "\033[1;36mAI:  \033[0m")
+                  << parsed["content"].get<std::string>() << "\n";
+    }
+    std::cout << messages.size() << " messages, about " << conversation.tokens() << " tokens" << std::endl;
+}
+
+void builtin_aicache(const Args &tokens, std::string_view) {
+    if (tokens[1] == "clear") {
+        ai_cache.clear();
+        std::cout << "AI cache cleared" << std::endl;
+    } else if (tokens[1] == "stats") {
+        AiCache::Stats stats = ai_cache.stats();
+        std::cout << "Directory: " << ai_cache.dir().string() << "\n";
+        std::cout << "Entries:   " << stats.entries << "\n";
+        std::cout << "Size:      " << stats.bytes << " of " << stats.limit << " bytes\n";
+        std::cout << "Session:   " << stats.hits << " hits, " << stats.misses << " misses" << std::endl;
+    } else {
+        show_error("Usage: aicache stats|clear");
+    }
+}
+
+void builtin_aimodels(const Args &, std::string_view) {
+    std::cout << "\nAvailable Groq AI Models:\n";
+    std::cout << "---------------------\n";
+    std::cout << "llama3-70b-8192     - Llama 3 70B (default)\n";
+    std::cout << "llama3-8b-8192      - Llama 3 8B (faster)\n";
+    std::cout << "mixtral-8x7b-32768  - Mixtral 8x7B\n";
+    std::cout << "gemma-7b-it         - Google Gemma 7B\n\n";
+    std::cout << "To change model: set AI_MODEL model_name\n";
+}
+
+enum class HelpSection { Core, Ai, Hidden };
+
+struct BuiltinCommand {
+    std::string_view name;
+    BuiltinHandler handler;
+    size_t minArgs;               // arguments required after the name
+    std::string_view usage;
+    std::string_view description;
+    HelpSection section;          // aliases are Hidden
+    bool literalArgs = false;     // takes the rest of the line, operators included
+};
+
+// Listed in `help` order
+constexpr BuiltinCommand builtin_commands[] = {
+    {"echo", builtin_echo, 0, "echo <text>", "Print text to console", HelpSection::Core},
+    {"set", builtin_set, 2, "set/let <var> <value>", "Set variable value", HelpSection::Core},
+    {"let", builtin_set, 2, "let <var> <value>", "", HelpSection::Hidden},
+    {"calc", builtin_calc, 1, "calc <expression>", "Evaluate an arithmetic expression", HelpSection::Core},
+    {"cd", builtin_cd, 1, "cd <directory>", "Change directory", HelpSection::Core},
+    {"ls", builtin_ls, 0, "ls/dir [-alRStr] [directory...]", "List directory contents", HelpSection::Core},
+    {"dir", builtin_ls, 0, "dir [-alRStr] [directory...]", "", HelpSection::Hidden},
+    {"mkdir", builtin_mkdir, 1, "mkdir <directory>", "Create directory", HelpSection::Core},
+    {"rm", builtin_rm, 1, "rm/del [-rf] <path>...", "Remove files or directories", HelpSection::Core},
+    {"del", builtin_rm, 1, "del [-rf] <path>...", "", HelpSection::Hidden},
+    {"cp", builtin_cp, 2, "cp [-r] <source>... <dest>", "Copy files or directories", HelpSection::Core},
+    {"mv", builtin_mv, 2, "mv <source>... <dest>", "Move or rename files", HelpSection::Core},
+    {"grep", builtin_grep, 2, "grep [-icnlvFr] [-o var] <pattern> <file>...", "Search files for a pattern", HelpSection::Core},
+    {"read", builtin_read, 2, "read <var> <file>", "Read file into variable", HelpSection::Core},
+    {"write", builtin_write, 2, "write <file> <content>", "Write content to file", HelpSection::Core},
+    {"append", builtin_append, 2, "append <file> <content>", "Append content to file", HelpSection::Core},
+    {"capture", builtin_capture, 2, "capture <var> <command>", "Store command output in variable", HelpSection::Core, true},
+    {"run", builtin_run, 1, "run <script>", "Run a script file", HelpSection::Core},
+    {"import", builtin_import, 1, "import <script>", "Import a script file", HelpSection::Core},
+    {"sleep", builtin_sleep, 1, "sleep <ms>", "Sleep for milliseconds", HelpSection::Core},
+    {"local", builtin_local, 1, "local <var> [value]", "Set variable local to a function", HelpSection::Core},
+    {"call", builtin_call, 1, "call <function> [args]", "Call a function (time, date, random)", HelpSection::Core},
+    {"jobs", builtin_jobs, 0, "jobs", "List background jobs", HelpSection::Core},
+    {"wait", builtin_wait, 0, "wait [%job...]", "Wait for background jobs", HelpSection::Core},
+    {"fg", builtin_fg, 0, "fg [%job]", "Wait for a job in the foreground", HelpSection::Core},
+    {"kill", builtin_kill, 1, "kill [-sig] <%job|pid>", "Send a signal to a job or process", HelpSection::Core},
+    {"sync", builtin_sync, 0, "sync", "Flush buffered write/append output", HelpSection::Core},
+    {"history", builtin_history, 0, "history [count|-c]", "Show or clear command history", HelpSection::Core},
+    {"timings", builtin_timings, 0, "timings", "Show builtin call counts and times", HelpSection::Core},
+    {"exit", builtin_exit, 0, "exit", "Exit the shell", HelpSection::Core},
+    {"quit", builtin_exit, 0, "quit", "", HelpSection::Hidden},
+    {"help", builtin_help, 0, "help", "Show this help", HelpSection::Core},
+    {"if", builtin_block_keyword, 0, "if <cond> ... end", "Run commands if condition holds", HelpSection::Core},
+    {"while", builtin_block_keyword, 0, "while <cond> ... end", "Loop while condition holds", HelpSection::Core},
+    {"for", builtin_block_keyword, 0, "for <v> in <words>", "Loop over words until end", HelpSection::Core},
+    {"func", builtin_block_keyword, 0, "func <name> ... end", "Define a function", HelpSection::Core},
+    {"parallel", builtin_block_keyword, 0, "parallel ... end", "Run the commands inside concurrently", HelpSection::Core},
+    {"ai", builtin_ai, 1, "ai <prompt>", "Ask AI a question", HelpSection::Ai, true},
+    {"aicode", builtin_aicode, 2, "aicode <lang> <description>", "Generate code in specified language", HelpSection::Ai, true},
+    {"aiexplain", builtin_aiexplain, 1, "aiexplain <file>...", "Explain code in one or more files", HelpSection::Ai},
+    {"aifix", builtin_aifix, 1, "aifix <file>...", "Fix and improve code in one or more files", HelpSection::Ai},
+    {"aicomplete", builtin_aicomplete, 2, "aicomplete <lang> <code>", "Complete partial code", HelpSection::Ai, true},
+    {"aiasync", builtin_aiasync, 1, "aiasync [-o var] <prompt>", "Ask AI in the background", HelpSection::Ai, true},
+    {"aiwait", builtin_aiwait, 0, "aiwait [id...]", "Wait for background AI answers", HelpSection::Ai},
+    {"aireset", builtin_aireset, 0, "aireset", "Forget the AI conversation", HelpSection::Ai},
+    {"aihistory", builtin_aihistory, 0, "aihistory", "Show the remembered AI conversation", HelpSection::Ai},
+    {"aicache", builtin_aicache, 1, "aicache stats|clear", "Show or clear cached AI answers", HelpSection::Ai},
+    {"aimodels", builtin_aimodels, 0, "aimodels", "List available AI models", HelpSection::Ai},
+};
+
+constexpr size_t kBuiltinCount = sizeof(builtin_commands) / sizeof(builtin_commands[0]);
+
+// Perfect hash over the builtin names: a seeded FNV-1a whose seed is searched
+// at compile time so that every name lands in its own slot.
+constexpr size_t kBuiltinSlots = 256;
+
+constexpr uint32_t builtin_hash(std::string_view name, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (char c : name) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    return hash ^ (hash >> 15);
+}
+
+struct BuiltinSlots {
+    uint32_t seed;
+    int8_t index[kBuiltinSlots];
+};
+
+constexpr BuiltinSlots build_builtin_slots() {
+    for (uint32_t seed = 0;; seed++) {
+        BuiltinSlots slots{seed, {}};
+        for (size_t i = 0; i < kBuiltinSlots; i++) slots.index[i] = -1;
+
+        bool collision = false;
+        for (size_t i = 0; i < kBuiltinCount && !collision; i++) {
+            size_t slot = builtin_hash(builtin_commands[i].name, seed) & (kBuiltinSlots - 1);
+            collision = slots.index[slot] != -1;
+            slots.index[slot] = static_cast<int8_t>(i);
+        }
+        if (!collision) return slots;
+    }
+}
+
+constexpr BuiltinSlots builtin_slots = build_builtin_slots();
+
+static_assert(kBuiltinCount <= kBuiltinSlots / 4, "grow kBuiltinSlots to keep the seed search short");
+
+const BuiltinCommand* find_builtin(std::string_view name) {
+    int index = builtin_slots.index[builtin_hash(name, builtin_slots.seed) & (kBuiltinSlots - 1)];
+    if (index < 0 || builtin_commands[index].name != name) return nullptr;
+    return &builtin_commands[index];
+}
+
+// Per-builtin timing counters, indexed like builtin_commands
+struct BuiltinStats {
+    uint64_t calls = 0;
+    std::chrono::nanoseconds total{0};
+};
+
+BuiltinStats builtin_stats[kBuiltinCount];
+
+// Validate arity, then run the handler and record how long it took
+void execute_builtin(const BuiltinCommand &command, const Args &tokens, std::string_view line) {
+    if (tokens.size() - 1 < command.minArgs) {
+        show_error("Usage: " + std::string(command.usage));
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    command.handler(tokens, line);
+    BuiltinStats &stats = builtin_stats[&command - builtin_commands];
+    stats.calls++;
+    stats.total += std::chrono::steady_clock::now() - start;
+}
+
+void builtin_help(const Args &, std::string_view) {
+    // One usage column for both sections, wide enough for the longest usage
+    size_t width = 0;
+    for (const BuiltinCommand &command : builtin_commands) {
+        if (command.section != HelpSection::Hidden) width = std::max(width, command.usage.size() + 1);
+    }
+    std::ios::fmtflags flags = std::cout.flags();
+    std::cout << std::left;
+
+    std::cout << "\nMyShell Commands:\n";
+    std::cout << "----------------\n";
+    for (const BuiltinCommand &command : builtin_commands) {
+        if (command.section != HelpSection::Core) continue;
+        std::cout << std::setw(static_cast<int>(width)) << command.usage << "- " << command.description << "\n";
+    }
+    
+    if (!groq_api_key.empty() || !ai_key_required()) {
+        std::cout << "\nAI Commands:\n";
+        std::cout << "------------\n";
+        for (const BuiltinCommand &command : builtin_commands) {
+            if (command.section != HelpSection::Ai) continue;
+            std::cout << std::setw(static_cast<int>(width)) << command.usage << "- " << command.description << "\n";
+        }
+    } else {
+        std::cout << "\nTo enable AI features, use: set GROQ_API_KEY your_api_key\n";
+    }
+    std::cout.flags(flags);
+}
+
+void builtin_timings(const Args &, std::string_view) {
+    std::cout << std::left << std::setw(14) << "Command" << std::right << std::setw(10) << "Calls"
+              << std::setw(14) << "Total (ms)" << std::setw(14) << "Avg (us)" << "\n";
+    std::cout << std::string(52, '-') << "\n";
+    for (size_t i = 0; i < kBuiltinCount; i++) {
+        const BuiltinStats &stats = builtin_stats[i];
+        if (stats.calls == 0) continue;
+        double totalMs = std::chrono::duration<double, std::milli>(stats.total).count();
+        std::cout << std::left << std::setw(14) << builtin_commands[i].name << std::right << std::setw(10) << stats.calls
+                  << std::setw(14) << std::fixed << std::setprecision(3) << totalMs
+                  << std::setw(14) << totalMs * 1000.0 / stats.calls << "\n";
+    }
+    std::cout.unsetf(std::ios::fixed);
+    std::cout << std::setprecision(6);
+}
+
+// Script Compiler
+// A line is lexed once at compile time. Lines containing `$` still have to
+// be expanded and lexed each time they run.
+struct PreparedLine {
+    std::string source; // the tokens are views into this string
+    LexedLine lexed;
+};
+
+struct CompiledLine {
+    std::string text;
+    bool needsExpansion;
+    // Only set when !needsExpansion. Held on the heap so the token views
+    // stay valid when the line is moved.
+    std::unique_ptr<PreparedLine> prepared;
+};
+
+bool is_command_separator(TokenKind kind) {
+    return kind == TokenKind::Semicolon || kind == TokenKind::And || kind == TokenKind::Or ||
+           kind == TokenKind::Background;
+}
+
+// Group tokens into commands at `;`, `&`, `&&` and `||`. A builtin that takes
+// its arguments literally (ai, capture, ...) owns the rest of the line.
+void split_commands(LexedLine &lexed) {
+    lexed.segments.clear();
+    const std::vector<Token> &tokens = lexed.tokens;
+    size_t first = 0;
+    while (first < tokens.size()) {
+        const BuiltinCommand* builtin = tokens[first].kind == TokenKind::Word ? find_builtin(tokens[first].text) : nullptr;
+        size_t last = first;
+        if (builtin && builtin->literalArgs) {
+            last = tokens.size();
+        } else {
+            while (last < tokens.size() && !is_command_separator(tokens[last].kind)) last++;
+        }
+        TokenKind separator = last < tokens.size() ? tokens[last].kind : TokenKind::Word;
+        if (last > first) lexed.segments.push_back({first, last, separator, builtin});
+        first = last + 1;
+    }
+}
+
+// Returns false for blank lines and comments, which produce no code
+bool compile_line(const std::string &line, CompiledLine &out) {
+    size_t start = line.find_first_not_of(" \t\r");
+    if (start == std::string::npos || line[start] == '#') return false;
+
+    out.text = line;
+    if (out.text.back() == '\r') out.text.pop_back(); // CRLF scripts
+    out.needsExpansion = out.text.find('$') != std::string::npos;
+    out.prepared.reset();
+
+    if (!out.needsExpansion) {
+        auto prepared = std::make_unique<PreparedLine>();
+        prepared->source = out.text;
+        lex_line(prepared->source, prepared->lexed);
+        split_commands(prepared->lexed);
+        if (prepared->lexed.segments.empty()) return false;
+        out.prepared = std::move(prepared);
+    }
+    return true;
+}
+
+// Script Interpreter
+// Scripts are parsed into a tree once; loop and function bodies are executed
+// from that tree without being parsed again.
+//
+//   if <cond> / elif <cond> / else / end
+//   while <cond> ... end
+//   for <var> in <words...> ... end
+//   func <name> ... end          (arguments are $1..$n, count in $#)
+//   parallel ... end             (commands only, run concurrently)
+//   break, continue, return [value]
+//
+// A condition is `<a> <op> <b>` with ==, !=, <, <=, >, >= (numeric when both
+// sides are numbers), `exists <path>`, or a single value that is true unless
+// it is empty, "0" or "false". Prefix with `not` to negate.
+enum class NodeKind { Command, If, While, For, Func, Parallel, Break, Continue, Return };
+
+struct Node {
+    NodeKind kind;
+    CompiledLine line;             // Command
+    std::vector<std::string> args; // If/While: condition tokens
+    std::string text;              // For: item list, Return: value
+    std::string name;              // For: loop variable, Func: function name
+    std::vector<Node> body;
+    std::vector<Node> elseBody;
+};
+
+using Block = std::vector<Node>;
+
+enum class Flow { Normal, Break, Continue, Return };
+
+struct CompiledScript {
+    fs::file_time_type mtime;
+    std::uintmax_t size;
+    Block body;
+    size_t commandCount = 0;
+};
+
+// User-defined functions. The aliasing shared_ptr keeps the script that
+// defined a function alive for as long as the function is registered.
+std::unordered_map<std::string, std::shared_ptr<const Node>> user_functions;
+std::shared_ptr<const CompiledScript> executing_script;
+
+const size_t kMaxCallDepth = 256;
+
+std::string first_word(const std::string &line) {
+    size_t start = line.find_first_not_of(" \t\r");
+    if (start == std::string::npos) return "";
+    size_t end = line.find_first_of(" \t\r", start);
+    return line.substr(start, end == std::string::npos ? std::string::npos : end - start);
+}
+
+// +1 for lines that open a block, -1 for `end`
+int block_depth_change(const std::string &line) {
+    std::string word = first_word(line);
+    if (word == "if" || word == "while" || word == "for" || word == "func" || word == "parallel") return 1;
+    if (word == "end") return -1;
+    return 0;
+}
+
+struct BlockCompiler {
+    const std::vector<std::string> &lines;
+    size_t pos = 0;
+    size_t commandCount = 0;
+
+    bool fail(const std::string &msg) {
+        show_error("Line " + std::to_string(pos + 1) + ": " + msg);
+        return false;
+    }
+
+    // Compile lines until `end`, `else`, `elif` or end of input. The keyword
+    // that stopped compilation is returned in `terminator` ("" at the end).
+    bool compile(Block &block, int loopDepth, std::string &terminator) {
+        for (; pos < lines.size(); pos++) {
+            const std::string &text = lines[pos];
+            std::string keyword = first_word(text);
+
+            if (keyword == "end" || keyword == "else" || keyword == "elif") {
+                terminator = keyword;
+                return true;
+            }
+
+            Node node;
+            if (keyword == "if") {
+                node.kind = NodeKind::If;
+                if (!compile_if(node, text, loopDepth)) return false;
+            } else if (keyword == "while") {
+                node.kind = NodeKind::While;
+                node.args = tokenize(rest_of_line(text, 1));
+                if (node.args.empty()) return fail("while needs a condition");
+                if (!compile_body(node.body, loopDepth + 1, "while")) return false;
+            } else if (keyword == "for") {
+                std::vector<std::string> header = tokenize(text);
+                if (header.size() < 3 || header[2] != "in") return fail("Usage: for <var> in <words...>");
+                node.kind = NodeKind::For;
+                node.name = header[1];
+                node.text = rest_of_line(text, 3);
+                if (!compile_body(node.body, loopDepth + 1, "for")) return false;
+            } else if (keyword == "func") {
+                std::vector<std::string> header = tokenize(text);
+                if (header.size() != 2) return fail("Usage: func <name>");
+                node.kind = NodeKind::Func;
+                node.name = header[1];
+                if (!compile_body(node.body, 0, "func")) return false;
+            } else if (keyword == "parallel") {
+                node.kind = NodeKind::Parallel;
+                size_t start = pos;
+                if (!compile_body(node.body, 0, "parallel")) return false;
+                for (const Node &child : node.body) {
+                    if (child.kind != NodeKind::Command) {
+                        pos = start;
+                        return fail("parallel blocks can only contain commands");
+                    }
+                }
+            } else if (keyword == "break" || keyword == "continue") {
+                if (loopDepth == 0) return fail(keyword + " outside of a loop");
+                node.kind = keyword == "break" ? NodeKind::Break : NodeKind::Continue;
+            } else if (keyword == "return") {
+                node.kind = NodeKind::Return;
+                node.text = rest_of_line(text, 1);
+            } else {
+                node.kind = NodeKind::Command;
+                if (!compile_line(text, node.line)) continue;
+                commandCount++;
+            }
+            block.push_back(std::move(node));
+        }
+        terminator.clear();
+        return true;
+    }
+
+    // Compile a block body that must be closed by `end`
+    bool compile_body(Block &body, int loopDepth, const std::string &opener) {
+        size_t start = pos++;
+        std::string terminator;
+        if (!compile(body, loopDepth, terminator)) return false;
+        if (terminator != "end") {
+            pos = start;
+            return fail(terminator.empty() ? opener + " without end" : terminator + " without if");
         }
+        return true;
     }
-    file.close();
-    std::cout << "Imported " << lines.size() << " commands from " << filename << std::endl;
-    // Will be executed in execute_script function
-    return;
-}
 
-// Variable Assignment and Expansion
-std::string expand_variables(const std::string &input) {
-    std::string result = input;
-    size_t pos = 0;
-    while ((pos = result.find('$', pos)) != std::string::npos) {
-        // Find the end of the variable name
-        size_t end = pos + 1;
-        while (end < result.length() && (isalnum(result[end]) || result[end] == '_')) {
-            end++;
+    bool compile_if(Node &node, const std::string &text, int loopDepth) {
+        size_t start = pos;
+        node.args = tokenize(rest_of_line(text, 1));
+        if (node.args.empty()) return fail("if needs a condition");
+
+        Node* branch = &node;
+        std::string terminator;
+        pos++;
+        if (!compile(branch->body, loopDepth, terminator)) return false;
+
+        while (terminator == "elif") {
+            Node elif;
+            elif.kind = NodeKind::If;
+            elif.args = tokenize(rest_of_line(lines[pos], 1));
+            if (elif.args.empty()) return fail("elif needs a condition");
+            pos++;
+            if (!compile(elif.body, loopDepth, terminator)) return false;
+            branch->elseBody.push_back(std::move(elif));
+            branch = &branch->elseBody.back();
         }
-        
-        if (end > pos + 1) {
-            std::string varName = result.substr(pos + 1, end - pos - 1);
-            if (variables.count(varName)) {
-                result.replace(pos, end - pos, variables[varName]);
-                // Don't increment pos here, as we need to check for variables in the replacement
-            } else {
-                // Variable not found, replace with empty string
-                result.replace(pos, end - pos, "");
-            }
-        } else {
-            // Lone $ character, just skip it
+        if (terminator == "else") {
             pos++;
+            if (!compile(branch->elseBody, loopDepth, terminator)) return false;
+        }
+        if (terminator != "end") {
+            pos = start;
+            return fail("if without end");
         }
+        return true;
     }
-    return result;
-}
+};
 
-// Math Functions
-std::string math_function(const std::string &func, double x) {
-    if (func == "sin") return std::to_string(sin(x));
-    if (func == "cos") return std::to_string(cos(x));
-    if (func == "tan") return std::to_string(tan(x));
-    if (func == "log") return std::to_string(log(x));
-    if (func == "exp") return std::to_string(exp(x));
-    if (func == "sqrt") return std::to_string(sqrt(x));
-    if (func == "round") return std::to_string(round(x));
-    if (func == "floor") return std::to_string(floor(x));
-    if (func == "ceil") return std::to_string(ceil(x));
-    
-    show_error("Unknown math function: " + func);
-    return "0";
+std::shared_ptr<CompiledScript> compile_source(const std::vector<std::string> &lines) {
+    auto script = std::make_shared<CompiledScript>();
+    BlockCompiler compiler{lines};
+    std::string terminator;
+    if (!compiler.compile(script->body, 0, terminator)) return nullptr;
+    if (!terminator.empty()) {
+        compiler.fail(terminator + " without matching block");
+        return nullptr;
+    }
+    script->commandCount = compiler.commandCount;
+    return script;
 }
 
-// Basic calculator function
-double calculate(const std::string &expression) {
-    // This is a very simplified calculator, would need a proper parser for a real one
-    // But for basic expressions, this can work
-    
-    std::istringstream ss(expression);
-    double left, right;
-    char op;
-    
-    ss >> left;
-    ss >> op;
-    ss >> right;
-    
-    switch (op) {
-        case '+': return left + right;
-        case '-': return left - right;
-        case '*': return left * right;
-        case '/': 
-            if (right == 0) {
-                show_error("Division by zero");
-                return 0;
-            }
-            return left / right;
-        default:
-            show_error("Unknown operator: " + std::string(1, op));
-            return 0;
+Flow execute_block(const Block &block);
+
+// Call frames hold function arguments and `local` variables
+struct CallFrameGuard {
+    explicit CallFrameGuard(Scope frame) {
+        call_frames.push_back(std::move(frame));
+    }
+    ~CallFrameGuard() { call_frames.pop_back(); }
+};
+
+void call_user_function(const Node &func, const Args &tokens) {
+    if (call_frames.size() >= kMaxCallDepth) {
+        show_error("Maximum function call depth exceeded in " + func.name);
+        return;
+    }
+    Scope frame;
+    for (size_t i = 1; i < tokens.size(); i++) {
+        frame[std::to_string(i)] = std::string(tokens[i]);
     }
+    frame["#"] = std::to_string(tokens.size() - 1);
+
+    CallFrameGuard guard(std::move(frame));
+    execute_block(func.body);
 }
 
-// Initialize Groq API
-bool init_groq_api() {
-    curl_global_init(CURL_GLOBAL_ALL);
-    
-    // Check if API key is set
-    if (variables.find("GROQ_API_KEY") != variables.end()) {
-        groq_api_key = variables["GROQ_API_KEY"];
-        std::cout << "\033[1;32mGroq AI API enabled\033[0m" << std::endl;
+// Call a user function or a registered `functions` entry by name
+bool call_function(const Args &args) {
+    std::string name(args[0]);
+    auto user = user_functions.find(name);
+    if (user != user_functions.end()) {
+        call_user_function(*user->second, args);
         return true;
     }
-    
-    std::cout << "\033[1;33mGroq AI API not configured. Use 'set GROQ_API_KEY your_api_key' to enable AI features.\033[0m" << std::endl;
-    return false;
+
+    auto registered = functions.find(name);
+    if (registered == functions.end()) return false;
+    std::string result = registered->second(std::vector<std::string>(args.begin() + 1, args.end()));
+    assign_variable("RESULT", result);
+    std::cout << result << std::endl;
+    return true;
 }
 
-// Make API request to Groq
-std::string call_groq_api(const std::string &prompt, const std::string &model = "llama3-70b-8192") {
-    if (groq_api_key.empty()) {
-        show_error("Groq API key not set. Use 'set GROQ_API_KEY your_api_key' to enable AI features.");
-        return "Error: API key not configured";
-    }
-    
-    CURL *curl = curl_easy_init();
-    std::string readBuffer;
-    
-    if(curl) {
-        struct curl_slist *headers = NULL;
-        headers = curl_slist_append(headers, "Content-Type: application/json");
-        std::string auth_header = "Authorization: Bearer " + groq_api_key;
-        headers = curl_slist_append(headers, auth_header.c_str());
-        
-        // Create the request JSON
-        json request_data = {
-            {"model", model},
-            {"messages", json::array({
-                {{"role", "user"}, {"content", prompt}}
-            })},
-            {"temperature", 0.7},
-            {"max_tokens", 1024}
-        };
-        
-        std::string request_body = request_data.dump();
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
-        curl_easy_setopt(curl, CURLOPT_URL, "https://api.groq.com/openai/v1/chat/completions");
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request_body.c_str());
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &readBuffer);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
-        
-        std::cout << "Asking AI... " << std::flush;
-        
-        CURLcode res = curl_easy_perform(curl);
-        
-        // Check for errors
-        if(res != CURLE_OK) {
-            show_error("Groq API request failed: " + std::string(curl_easy_strerror(res)));
-            curl_slist_free_all(headers);
-            curl_easy_cleanup(curl);
-            return "Error calling Groq API";
-        }
-        
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
-        
-        try {
-            // Parse the JSON response
-            json response = json::parse(readBuffer);
-            
-            if (response.contains("choices") && response["choices"].size() > 0 &&
-                response["choices"][0].contains("message") && 
-                response["choices"][0]["message"].contains("content")) {
-                
-                std::string result = response["choices"][0]["message"]["content"];
-                return result;
-            } else if (response.contains("error") && response["error"].contains("message")) {
-                return "API Error: " + response["error"]["message"].get<std::string>();
-            } else {
-                return "Error parsing response from Groq API";
-            }
-        } catch (const std::exception& e) {
-            show_error("Failed to parse Groq API response: " + std::string(e.what()));
-            return "Error parsing response";
-        }
+// Sends std::cout somewhere else for as long as it is alive. External
+// commands notice capture_depth and write through std::cout instead of
+// straight to the terminal.
+struct OutputRedirect {
+    std::streambuf* previous;
+
+    explicit OutputRedirect(std::streambuf* target) : previous(std::cout.rdbuf(target)) { capture_depth++; }
+    ~OutputRedirect() {
+        std::cout.rdbuf(previous);
+        capture_depth--;
     }
-    
-    return "Error initializing CURL";
+};
+
+// `2>` for builtins: their errors go to std::cerr
+struct ErrorRedirect {
+    std::streambuf* previous;
+
+    explicit ErrorRedirect(std::streambuf* target) : previous(std::cerr.rdbuf(target)) {}
+    ~ErrorRedirect() { std::cerr.rdbuf(previous); }
+};
+
+// Open the file of a `>`, `>>`, `2>` or `2>>` redirect
+bool open_redirect(std::string_view target, bool append, std::ofstream &file) {
+    std::string key = file_key(std::string(target));
+    close_open_file(key);
+    if (!append) detach_mapping(key);
+    file.open(key, append ? std::ios::app : std::ios::trunc);
+    if (!file) show_error("Cannot write to file: " + std::string(target));
+    return static_cast<bool>(file);
 }
 
-// AI Command Implementation
-std::string ai_command(const std::vector<std::string>& tokens) {
-    if (tokens.size() < 2) {
-        show_error("Usage: ai <prompt>");
-        return "";
-    }
-    
-    // Combine all tokens after "ai" into the prompt
-    std::string prompt;
-    for (size_t i = 1; i < tokens.size(); i++) {
-        prompt += tokens[i] + " ";
-    }
-    
-    std::string model = variables.count("AI_MODEL") ? variables["AI_MODEL"] : "llama3-70b-8192";
-    return call_groq_api(prompt, model);
+// Run one command of a line and return its status. Builtins and functions
+// get the words of the command and may redirect their output with > or >>
+// and their errors with 2> or 2>>;
+// anything else, including builtins used in a pipeline, goes to the process
+// engine as written.
+std::string_view segment_text(std::string_view source, const LexedLine &lexed, const CommandSegment &segment) {
+    size_t begin = lexed.tokens[segment.first].begin;
+    return source.substr(begin, lexed.tokens[segment.last - 1].end - begin);
 }
 
-// AI Code Command
-std::string ai_code_command(const std::vector<std::string>& tokens) {
-    if (tokens.size() < 3) {
-        show_error("Usage: aicode <language> <description>");
-        return "";
-    }
-    
-    std::string language = tokens[1];
-    
-    // Combine all tokens after language into the description
-    std::string description;
-    for (size_t i = 2; i < tokens.size(); i++) {
-        description += tokens[i] + " ";
-    }
-    
-    std::string prompt = "Write a " + language + " program that " + description + 
-                          ". Provide only the code without explanations.";
-    
-    std::string model = variables.count("AI_MODEL") ? variables["AI_MODEL"] : "llama3-70b-8192";
-    return call_groq_api(prompt, model);
+// Whether a command is run by the process engine rather than the shell
+bool is_external_segment(const LexedLine &lexed, const CommandSegment &segment) {
+    if (segment.builtin) return false;
+    const Token &head = lexed.tokens[segment.first];
+    return user_functions.empty() || head.kind != TokenKind::Word ||
+           user_functions.find(std::string(head.text)) == user_functions.end();
 }
 
-// AI Explain Code Command
-std::string ai_explain_command(const std::vector<std::string>& tokens) {
-    if (tokens.size() < 2) {
-        show_error("Usage: aiexplain <file.cpp>");
-        return "";
+int execute_segment(std::string_view source, const LexedLine &lexed, const CommandSegment &segment, CommandScratch &scratch) {
+    const std::vector<Token> &tokens = lexed.tokens;
+    std::string_view text = segment_text(source, lexed, segment);
+
+    const Node* function = nullptr;
+    if (!segment.builtin && !user_functions.empty() && tokens[segment.first].kind == TokenKind::Word) {
+        auto user = user_functions.find(std::string(tokens[segment.first].text));
+        if (user != user_functions.end()) function = user->second.get();
     }
-    
-    std::string filename = tokens[1];
-    std::string code = read_file(filename);
-    
-    if (code.empty()) {
-        return "Could not read file: " + filename;
+    // Pipes and input redirection need real processes
+    bool external = !segment.builtin && !function;
+    for (size_t i = segment.first + 1; i < segment.last && !external; i++) {
+        TokenKind kind = tokens[i].kind;
+        external = kind == TokenKind::Pipe || kind == TokenKind::RedirectIn;
     }
-    
-    std::string prompt = "Explain the following code in detail:\n\n" + code;
-    
-    std::string model = variables.count("AI_MODEL") ? variables["AI_MODEL"] : "llama3-70b-8192";
-    return call_groq_api(prompt, model);
-}
-
-// AI Fix Code Command
-std::string ai_fix_command(const std::vector<std::string>& tokens) {
-    if (tokens.size() < 2) {
-        show_error("Usage: aifix <file.cpp>");
-        return "";
+    if (external && !(segment.builtin && segment.builtin->literalArgs)) {
+        release_files();
+        last_status = run_external_command(std::string(text));
+        return last_status;
     }
-    
-    std::string filename = tokens[1];
-    std::string code = read_file(filename);
-    
-    if (code.empty()) {
-        return "Could not read file: " + filename;
+
+    Args &args = scratch.args;
+    args.clear();
+    if (segment.builtin && segment.builtin->literalArgs) {
+        lex_line(text, scratch.literal, false);
+        for (const Token &token : scratch.literal.tokens) args.push_back(token.text);
+        last_status = 0;
+        execute_builtin(*segment.builtin, args, text);
+        return last_status;
     }
-    
-    std::string prompt = "Fix errors and improve the following code:\n\n" + code + 
-                         "\n\nPlease provide only the corrected code without explanations.";
-    
-    std::string model = variables.count("AI_MODEL") ? variables["AI_MODEL"] : "llama3-70b-8192";
-    std::string result = call_groq_api(prompt, model);
-    
-    // Ask user if they want to overwrite the file
-    std::cout << "Do you want to overwrite " << filename << " with the fixed code? (y/n): ";
-    std::string answer;
-    std::getline(std::cin, answer);
-    
-    if (answer == "y" || answer == "Y") {
-        write_file(filename, result);
-        std::cout << "File " << filename << " updated with fixed code." << std::endl;
+
+    std::string_view target, errorTarget;
+    bool append = false, errorAppend = false;
+    for (size_t i = segment.first; i < segment.last; i++) {
+        const Token &token = tokens[i];
+        switch (token.kind) {
+        case TokenKind::Word:
+            args.push_back(token.text);
+            break;
+        case TokenKind::RedirectOut:
+        case TokenKind::RedirectAppend:
+        case TokenKind::RedirectErr:
+        case TokenKind::RedirectErrAppend:
+            if (i + 1 == segment.last || tokens[i + 1].kind != TokenKind::Word) {
+                show_error("Missing file name after " + std::string(token.text));
+                return last_status;
+            }
+            if (token.kind == TokenKind::RedirectErr || token.kind == TokenKind::RedirectErrAppend) {
+                errorTarget = tokens[++i].text;
+                errorAppend = token.kind == TokenKind::RedirectErrAppend;
+            } else {
+                target = tokens[++i].text;
+                append = token.kind == TokenKind::RedirectAppend;
+            }
+            break;
+        default:
+            break; // 2>&1: errors already go to the terminal
+        }
     }
-    
-    return result;
-}
 
-// AI Generate Command completion
-std::string ai_complete_command(const std::vector<std::string>& tokens) {
-    if (tokens.size() < 3) {
-        show_error("Usage: aicomplete <language> \"<partial code>\"");
-        return "";
+    std::ofstream errors;
+    std::unique_ptr<ErrorRedirect> errorRedirect;
+    if (!errorTarget.empty()) {
+        if (!open_redirect(errorTarget, errorAppend, errors)) return last_status;
+        errorRedirect = std::make_unique<ErrorRedirect>(errors.rdbuf());
     }
-    
-    std::string language = tokens[1];
-    std::string partial_code;
-    
-    // Combine all tokens after language into the partial code
-    for (size_t i = 2; i < tokens.size(); i++) {
-        partial_code += tokens[i] + " ";
+    std::ofstream file;
+    std::unique_ptr<OutputRedirect> redirect;
+    if (!target.empty()) {
+        if (!open_redirect(target, append, file)) return last_status;
+        redirect = std::make_unique<OutputRedirect>(file.rdbuf());
     }
-    
-    std::string prompt = "Complete the following " + language + " code:\n\n" + partial_code + 
-                         "\n\nProvide only the completed code.";
-    
-    std::string model = variables.count("AI_MODEL") ? variables["AI_MODEL"] : "llama3-70b-8192";
-    return call_groq_api(prompt, model);
+
+    last_status = 0;
+    if (segment.builtin) execute_builtin(*segment.builtin, args, text);
+    else call_user_function(*function, args);
+    return last_status;
 }
 
-// Process a single command
-void process_command(const std::string &command) {
-    if (command.empty()) return;
-    
-    // Skip comments
-    if (command[0] == '#') return;
-    
-    std::string expandedCommand = expand_variables(command);
-    std::vector<std::string> tokens = tokenize(expandedCommand);
-    
-    if (tokens.empty()) return;
-    
-    // Command processing
-    if (tokens[0] == "echo") {
-        for (size_t i = 1; i < tokens.size(); i++) {
-            std::cout << tokens[i] << " ";
-        }
-        std::cout << std::endl;
-    }
-    else if (tokens[0] == "set" || tokens[0] == "let") {
-        if (tokens.size() < 3) {
-            show_error("Usage: set <variable> <value>");
-            return;
+// Text from the start of segment `first` to the end of segment `last`
+std::string_view segments_text(std::string_view source, const LexedLine &lexed, size_t first, size_t last) {
+    size_t begin = lexed.tokens[lexed.segments[first].first].begin;
+    return source.substr(begin, lexed.tokens[lexed.segments[last].last - 1].end - begin);
+}
+
+// Run the commands of a line. `&&` and `||` skip the next command depending
+// on the status of the last one that ran, as in sh. A list of commands
+// followed by `&` runs as a background job in its own process.
+void execute_lexed(std::string_view source, const LexedLine &lexed, CommandScratch &scratch) {
+    const std::vector<CommandSegment> &segments = lexed.segments;
+    for (size_t first = 0; first < segments.size() && !exit_requested;) {
+        // A list runs up to the next `;`, `&` or the end of the line
+        size_t last = first;
+        while (last + 1 < segments.size() &&
+               (segments[last].separator == TokenKind::And || segments[last].separator == TokenKind::Or)) {
+            last++;
         }
-        std::string value;
-        for (size_t i = 2; i < tokens.size(); i++) {
-            value += tokens[i] + " ";
+
+        if (segments[last].separator == TokenKind::Background) {
+            release_files();
+#ifdef _WIN32
+            show_error("Background jobs are not supported on Windows");
+#else
+            start_background_job(std::string(segments_text(source, lexed, first, last)));
+#endif
+            first = last + 1;
+            continue;
         }
-        if (!value.empty()) value.pop_back(); // Remove trailing space
-        variables[tokens[1]] = value;
-        
-        // If setting GROQ_API_KEY, initialize API
-        if (tokens[1] == "GROQ_API_KEY") {
-            groq_api_key = value;
-            std::cout << "\033[1;32mGroq AI API key set. AI features are now enabled.\033[0m" << std::endl;
+
+        bool run = true;
+        for (size_t i = first; i <= last && !exit_requested; i++) {
+            if (run) execute_segment(source, lexed, segments[i], scratch);
+            if (segments[i].separator == TokenKind::And) run = last_status == 0;
+            else if (segments[i].separator == TokenKind::Or) run = last_status != 0;
         }
-        
-        std::cout << "Variable " << tokens[1] << " set to: " << value << std::endl;
+        first = last + 1;
     }
-    else if (tokens[0] == "calc") {
-        if (tokens.size() < 2) {
-            show_error("Usage: calc <expression>");
-            return;
-        }
-        std::string expr;
-        for (size_t i = 1; i < tokens.size(); i++) {
-            expr += tokens[i] + " ";
-        }
-        if (!expr.empty()) expr.pop_back(); // Remove trailing space
-        double result = calculate(expr);
-        std::cout << expr << " = " << result << std::endl;
+}
+
+void execute_line(const CompiledLine &line) {
+    ScratchGuard guard;
+    CommandScratch &scratch = guard.scratch;
+    if (line.prepared) {
+        execute_lexed(line.prepared->source, line.prepared->lexed, scratch);
+        return;
     }
-    else if (tokens[0] == "read") {
-        if (tokens.size() < 3) {
-            show_error("Usage: read <variable> <file>");
-            return;
-        }
-        std::string content = read_file(tokens[2]);
-        variables[tokens[1]] = content;
-        std::cout << "Read file content into variable " << tokens[1] << std::endl;
+
+    scratch.expanded.clear();
+    expand_variables_into(line.text, scratch.expanded, true);
+    lex_line(scratch.expanded, scratch.lexed);
+    split_commands(scratch.lexed);
+    execute_lexed(scratch.expanded, scratch.lexed, scratch);
+}
+
+bool parse_number(const std::string &text, double &value) {
+    if (text.empty()) return false;
+    char* end = nullptr;
+    value = std::strtod(text.c_str(), &end);
+    return end == text.c_str() + text.length();
+}
+
+bool is_truthy(const std::string &value) {
+    return !value.empty() && value != "0" && value != "false";
+}
+
+// Condition tokens are expanded one by one, so values containing spaces stay
+// a single operand
+bool evaluate_condition(std::vector<std::string> args) {
+    for (std::string &arg : args) {
+        if (arg.find('$') != std::string::npos) arg = expand_variables(arg);
     }
-    else if (tokens[0] == "write") {
-        if (tokens.size() < 3) {
-            show_error("Usage: write <file> <content>");
-            return;
+
+    size_t i = 0;
+    bool negate = false;
+    while (i < args.size() && (args[i] == "not" || args[i] == "!")) {
+        negate = !negate;
+        i++;
+    }
+
+    size_t count = args.size() - i;
+    bool result = false;
+    if (count == 1) {
+        result = is_truthy(args[i]);
+    } else if (count == 2 && args[i] == "exists") {
+        std::error_code ec;
+        result = fs::exists(args[i + 1], ec);
+    } else if (count == 3) {
+        const std::string &left = args[i], &op = args[i + 1], &right = args[i + 2];
+        double a, b;
+        int cmp;
+        if (parse_number(left, a) && parse_number(right, b)) cmp = a < b ? -1 : (a > b ? 1 : 0);
+        else cmp = left.compare(right) < 0 ? -1 : (left == right ? 0 : 1);
+
+        if (op == "==") result = cmp == 0;
+        else if (op == "!=") result = cmp != 0;
+        else if (op == "<") result = cmp < 0;
+        else if (op == "<=") result = cmp <= 0;
+        else if (op == ">") result = cmp > 0;
+        else if (op == ">=") result = cmp >= 0;
+        else show_error("Unknown comparison operator: " + op);
+    } else if (count != 0) {
+        show_error("Invalid condition: " + join_tokens(Args(args.begin(), args.end()), 0));
+    }
+    return result != negate;
+}
+
+// Run the commands of a `parallel` block at the same time. External
+// commands go to the worker pool, so at most one per core runs at once;
+// builtins and functions run on the shell's thread meanwhile. Each command's
+// output is collected separately and printed in the order the commands were
+// written once all of them have finished.
+void execute_parallel(const Node &node) {
+    struct Task {
+        std::string command;
+        std::string output;
+        std::string error;
+        int status = 0;
+        std::future<void> done;
+    };
+    std::vector<Task> tasks(node.body.size());
+
+    auto wait_all = [&]() {
+        for (Task &task : tasks) {
+            if (task.done.valid()) task.done.wait();
         }
-        std::string content;
-        for (size_t i = 2; i < tokens.size(); i++) {
-            content += tokens[i] + " ";
+    };
+
+    try {
+        for (size_t i = 0; i < node.body.size() && !exit_requested; i++) {
+            const CompiledLine &line = node.body[i].line;
+            Task &task = tasks[i];
+
+            ScratchGuard guard;
+            CommandScratch &scratch = guard.scratch;
+            std::string_view source;
+            const LexedLine* lexed;
+            if (line.prepared) {
+                source = line.prepared->source;
+                lexed = &line.prepared->lexed;
+            } else {
+                scratch.expanded.clear();
+                expand_variables_into(line.text, scratch.expanded, true);
+                lex_line(scratch.expanded, scratch.lexed);
+                split_commands(scratch.lexed);
+                source = scratch.expanded;
+                lexed = &scratch.lexed;
+            }
+            if (lexed->segments.empty()) continue;
+
+#ifndef _WIN32
+            bool external = std::all_of(lexed->segments.begin(), lexed->segments.end(),
+                [&](const CommandSegment &segment) { return is_external_segment(*lexed, segment); });
+            if (external) {
+                release_files();
+                task.command = std::string(segments_text(source, *lexed, 0, lexed->segments.size() - 1));
+                task.done = worker_pool().submit([&task, stages = build_pipeline(task.command)]() {
+                    task.status = run_pipeline_captured(task.command, stages, task.output, &task.error);
+                });
+                continue;
+            }
+#endif
+
+            std::ostringstream captured;
+            {
+                OutputRedirect redirect(captured.rdbuf());
+                execute_lexed(source, *lexed, scratch);
+            }
+            task.output = captured.str();
+            task.status = last_status;
         }
-        if (!content.empty()) content.pop_back(); // Remove trailing space
-        write_file(tokens[1], content);
+    } catch (...) {
+        wait_all();
+        throw;
     }
-    else if (tokens[0] == "append") {
-        if (tokens.size() < 3) {
-            show_error("Usage: append <file> <content>");
-            return;
+    wait_all();
+
+    int status = 0;
+    for (Task &task : tasks) {
+        std::cout << task.output;
+        if (!task.error.empty()) {
+            task.error.pop_back();
+            show_error(task.error);
         }
-        std::string content;
-        for (size_t i = 2; i < tokens.size(); i++) {
-            content += tokens[i] + " ";
+        if (task.status < 0) task.status = 127;
+        if (task.status != 0 && !task.command.empty()) {
+            show_error("Command exited with status " + std::to_string(task.status) + ": " + task.command);
         }
-        if (!content.empty()) content.pop_back(); // Remove trailing space
-        append_file(tokens[1], content);
+        if (task.status != 0) status = task.status;
     }
-    else if (tokens[0] == "cd") {
-        change_directory(tokens);
-    }
-    else if (tokens[0] == "ls" || tokens[0] == "dir") {
-        if (tokens.size() > 1) {
-            list_directory(tokens[1]);
-        } else {
-            list_directory();
+    std::cout.flush();
+    last_status = status;
+}
+
+Flow execute_node(const Node &node) {
+    switch (node.kind) {
+    case NodeKind::Command:
+        execute_line(node.line);
+        return Flow::Normal;
+    case NodeKind::If:
+        return execute_block(evaluate_condition(node.args) ? node.body : node.elseBody);
+    case NodeKind::While:
+        while (!exit_requested && evaluate_condition(node.args)) {
+            Flow flow = execute_block(node.body);
+            if (flow == Flow::Break) break;
+            if (flow == Flow::Return) return flow;
         }
-    }
-    else if (tokens[0] == "mkdir") {
-        if (tokens.size() < 2) {
-            show_error("Usage: mkdir <directory>");
-            return;
+        return Flow::Normal;
+    case NodeKind::For: {
+        std::vector<std::string> items = tokenize(expand_variables(node.text));
+        for (const std::string &item : items) {
+            if (exit_requested) break;
+            assign_variable(node.name, item);
+            Flow flow = execute_block(node.body);
+            if (flow == Flow::Break) break;
+            if (flow == Flow::Return) return flow;
         }
-        create_directory(tokens[1]);
+        return Flow::Normal;
     }
-    else if (tokens[0] == "rm" || tokens[0] == "del") {
-        if (tokens.size() < 2) {
-            show_error("Usage: rm <file_or_directory>");
-            return;
-        }
-        remove_file_or_directory(tokens[1]);
+    case NodeKind::Func:
+        user_functions[node.name] = std::shared_ptr<const Node>(executing_script, &node);
+        return Flow::Normal;
+    case NodeKind::Parallel:
+        execute_parallel(node);
+        return Flow::Normal;
+    case NodeKind::Break:
+        return Flow::Break;
+    case NodeKind::Continue:
+        return Flow::Continue;
+    case NodeKind::Return:
+        if (!node.text.empty()) assign_variable("RESULT", expand_variables(node.text));
+        return Flow::Return;
     }
-    else if (tokens[0] == "import") {
-        if (tokens.size() < 2) {
-            show_error("Usage: import <scriptfile>");
-            return;
-        }
-        import_script(tokens[1]);
+    return Flow::Normal;
+}
+
+Flow execute_block(const Block &block) {
+    for (const Node &node : block) {
+        if (exit_requested) return Flow::Return;
+        Flow flow = execute_node(node);
+        if (flow != Flow::Normal) return flow;
     }
-    else if (tokens[0] == "sleep") {
-        if (tokens.size() < 2) {
-            show_error("Usage: sleep <milliseconds>");
-            return;
-        }
-        try {
-            int ms = std::stoi(tokens[1]);
-            std::cout << "Sleeping for " << ms << "ms..." << std::endl;
-            Sleep(ms);
-        } catch (...) {
-            show_error("Invalid sleep time: " + tokens[1]);
-        }
+    return Flow::Normal;
+}
+
+// Execute Script
+void execute_script(const std::shared_ptr<const CompiledScript> &script) {
+    std::shared_ptr<const CompiledScript> previous = executing_script;
+    executing_script = script;
+    execute_block(script->body);
+    executing_script = previous;
+}
+
+// Process a single command
+void process_command(const std::string &command) {
+    CompiledLine line;
+    if (compile_line(command, line)) {
+        execute_line(line);
     }
-    // AI Commands
-    else if (tokens[0] == "ai") {
-        std::string response = ai_command(tokens);
-        std::cout << "\n\033[1;36m" << response << "\033[0m\n" << std::endl;
+}
+
+// Run a command for $(...) with everything it prints captured. Trailing
+// whitespace is removed like a shell removes newlines.
+std::string capture_command_output(const std::string &command) {
+    std::ostringstream captured;
+    {
+        OutputRedirect redirect(captured.rdbuf());
+        process_command(command);
     }
-    else if (tokens[0] == "aicode") {
-        std::string code = ai_code_command(tokens);
-        std::cout << "\n\033[1;32m" << code << "\033[0m\n" << std::endl;
-        
-        // Ask user if they want to save the code to a file
-        std::cout << "Do you want to save this code to a file? (y/n): ";
-        std::string answer;
-        std::getline(std::cin, answer);
-        
-        if (answer == "y" || answer == "Y") {
-            std::cout << "Enter filename: ";
-            std::string filename;
-            std::getline(std::cin, filename);
-            write_file(filename, code);
-        }
-    }
-    else if (tokens[0] == "aiexplain") {
-        std::string explanation = ai_explain_command(tokens);
-        std::cout << "\n\033[1;36m" << explanation << "\033[0m\n" << std::endl;
-    }
-    else if (tokens[0] == "aifix") {
-        std::string fixed_code = ai_fix_command(tokens);
-        std::cout << "\n\033[1;32m" << fixed_code << "\033[0m\n" << std::endl;
-    }
-    else if (tokens[0] == "aicomplete") {
-        std::string completed_code = ai_complete_command(tokens);
-        std::cout << "\n\033[1;32m" << completed_code << "\033[0m\n" << std::endl;
-    }
-    else if (tokens[0] == "aimodels") {
-        std::cout << "\nAvailable Groq AI Models:\n";
-        std::cout << "---------------------\n";
-        std::cout << "llama3-70b-8192     - Llama 3 70B (default)\n";
-        std::cout << "llama3-8b-8192      - Llama 3 8B (faster)\n";
-        std::cout << "mixtral-8x7b-32768  - Mixtral 8x7B\n";
-        std::cout << "gemma-7b-it         - Google Gemma 7B\n\n";
-        std::cout << "To change model: set AI_MODEL model_name\n";
-    }
-    else if (tokens[0] == "help") {
-        std::cout << "\nMyShell Commands:\n";
-        std::cout << "----------------\n";
-        std::cout << "echo <text>              - Print text to console\n";
-        std::cout << "set/let <var> <value>    - Set variable value\n";
-        std::cout << "calc <expression>        - Calculate simple expression\n";
-        std::cout << "cd <directory>           - Change directory\n";
-        std::cout << "ls/dir [directory]       - List directory contents\n";
-        std::cout << "mkdir <directory>        - Create directory\n";
-        std::cout << "rm/del <path>            - Remove file or directory\n";
-        std::cout << "read <var> <file>        - Read file into variable\n";
-        std::cout << "write <file> <content>   - Write content to file\n";
-        std::cout << "append <file> <content>  - Append content to file\n";
-        std::cout << "run <script>             - Run a script file\n";
-        std::cout << "import <script>          - Import a script file\n";
-        std::cout << "sleep <ms>               - Sleep for milliseconds\n";
-        std::cout << "exit                     - Exit the shell\n";
-        std::cout << "help                     - Show this help\n";
-        
-        if (!groq_api_key.empty()) {
-            std::cout << "\nAI Commands:\n";
-            std::cout << "------------\n";
-            std::cout << "ai <prompt>                   - Ask AI a question\n";
-            std::cout << "aicode <lang> <description>   - Generate code in specified language\n";
-            std::cout << "aiexplain <file>              - Explain code in a file\n";
-            std::cout << "aifix <file>                  - Fix and improve code in a file\n";
-            std::cout << "aicomplete <lang> <code>      - Complete partial code\n";
-            std::cout << "aimodels                      - List available AI models\n";
-        } else {
-            std::cout << "\nTo enable AI features, use: set GROQ_API_KEY your_api_key\n";
-        }
+    std::string output = captured.str();
+    size_t end = output.find_last_not_of(" \t\r\n");
+    output.erase(end == std::string::npos ? 0 : end + 1);
+    return output;
+}
+
+// Compile and run lines typed interactively (used for multi-line blocks)
+void process_block(const std::vector<std::string> &lines) {
+    std::shared_ptr<const CompiledScript> script = compile_source(lines);
+    if (script) execute_script(script);
+}
+
+// Compiled scripts keyed by canonical path, reused until the file changes
+std::unordered_map<std::string, std::shared_ptr<const CompiledScript>> script_cache;
+
+// Returns nullptr if the file cannot be read or does not compile; `opened`
+// tells the two apart
+std::shared_ptr<const CompiledScript> compile_script(const std::string &filename, bool &opened) {
+    std::error_code ec;
+    fs::path path = fs::weakly_canonical(filename, ec);
+    if (ec) path = filename;
+    fs::file_time_type mtime = fs::last_write_time(path, ec);
+    std::uintmax_t size = ec ? 0 : fs::file_size(path, ec);
+
+    auto cached = script_cache.find(path.string());
+    if (!ec && cached != script_cache.end() && cached->second->mtime == mtime && cached->second->size == size) {
+        opened = true;
+        return cached->second;
     }
-    else {
-        // If not a built-in command, try to execute it as an external command
-        std::string output = execute_command(expandedCommand);
-        std::cout << output;
+
+    std::ifstream scriptFile(path);
+    opened = scriptFile.is_open();
+    if (!opened) return nullptr;
+
+    std::vector<std::string> lines;
+    std::string text;
+    while (std::getline(scriptFile, text)) {
+        lines.push_back(std::move(text));
     }
+
+    std::shared_ptr<CompiledScript> script = compile_source(lines);
+    if (!script) return nullptr;
+    script->mtime = mtime;
+    script->size = size;
+
+    if (!ec) script_cache[path.string()] = script;
+    return script;
 }
 
-// Execute Script
-void execute_script(const std::vector<std::string> &lines) {
-    for (const std::string &line : lines) {
-        process_command(line);
+// Run a script file's commands; an `exit` in it ends only the script
+void execute_script_file(const std::shared_ptr<const CompiledScript> &script) {
+    script_depth++;
+    try {
+        execute_script(script);
+    } catch (...) {
+        script_depth--;
+        throw;
     }
+    script_depth--;
+    exit_requested = false;
 }
 
 // Run Scripts
 void run_script(const std::string &filename) {
-    std::ifstream scriptFile(filename);
-    if (!scriptFile.is_open()) {
-        show_error("Unable to open script file: " + filename);
+    bool opened;
+    std::shared_ptr<const CompiledScript> script = compile_script(filename, opened);
+    if (!script) {
+        show_error((opened ? "Failed to compile script: " : "Unable to open script file: ") + filename);
         return;
     }
     
-    std::vector<std::string> lines;
-    std::string line;
-    while (std::getline(scriptFile, line)) {
-        lines.push_back(line);
-    }
-    scriptFile.close();
-    
-    std::cout << "Running script " << filename << " (" << lines.size() << " commands)" << std::endl;
-    execute_script(lines);
+    std::cout << "Running script " << filename << " (" << script->commandCount << " commands)" << std::endl;
+    execute_script_file(script);
+    sync_open_files();
     std::cout << "Script execution completed" << std::endl;
 }
 
+// Import External Scripts
+// Runs the script in the current context, so its functions and variables
+// become available to the caller
+void import_script(const std::string &filename) {
+    bool opened;
+    std::shared_ptr<const CompiledScript> script = compile_script(filename, opened);
+    if (!script) {
+        show_error("Failed to import script: " + filename);
+        return;
+    }
+    execute_script_file(script);
+    std::cout << "Imported " << script->commandCount << " commands from " << filename << std::endl;
+}
+
 // Run Shell
 void run_shell() {
     // Set some environment variables
     variables["PATH"] = getenv("PATH") ? getenv("PATH") : "";
+#ifdef _WIN32
     variables["USER"] = getenv("USERNAME") ? getenv("USERNAME") : "user";
     variables["HOME"] = getenv("USERPROFILE") ? getenv("USERPROFILE") : ".";
+#else
+    variables["USER"] = getenv("USER") ? getenv("USER") : "user";
+    variables["HOME"] = getenv("HOME") ? getenv("HOME") : ".";
+#endif
     variables["SHELL"] = "MyShell";
     variables["AI_MODEL"] = "llama3-70b-8192";
+    // History settings are needed before the first command runs
+    for (const char *name : {"HISTORY", "HISTORY_FILE", "HISTORY_SIZE"}) {
+        if (const char *value = getenv(name)) variables[name] = value;
+    }
 
     // Display welcome message
     std::cout << "\n==========================================================\n";
@@ -767,66 +6987,80 @@ void run_shell() {
     
     // Initialize Groq API if possible
     init_groq_api();
+    command_history.load();
     
     // Main command loop
     std::string input;
     while (true) {
+#ifndef _WIN32
+        report_finished_jobs();
+#endif
+        report_finished_ai();
         // Display prompt
         std::string currentDir = fs::current_path().string();
-        std::cout << "\033[1;33m" << variables["USER"] << "@MyShell\033[0m:\033[1;34m" << currentDir << "\033[0m$ ";
+        std::string prompt = "\033[1;33m" + std::string(variables["USER"].view()) + "@MyShell\033[0m:\033[1;34m" + currentDir + "\033[0m$ ";
         
         // Get input
-        if (!std::getline(std::cin, input)) {
+        if (!read_command_line(prompt, input)) {
             break; // Exit on EOF
         }
+        if (!expand_history(input)) continue;
         
         // Log the command
         log_message("Command executed: " + input);
+        command_history.add(input);
         
-        // Exit condition
-        if (input == "exit" || input == "quit") {
-            std::cout << "Exiting MyShell. Goodbye!" << std::endl;
-            break;
+        // Blocks (if/while/for/func) continue until the matching `end`
+        std::vector<std::string> block;
+        int depth = block_depth_change(input);
+        if (depth > 0) {
+            block.push_back(input);
+            std::string line;
+            while (depth > 0) {
+                if (!read_command_line("> ", line)) break;
+                log_message("Command executed: " + line);
+                command_history.add(line);
+                block.push_back(line);
+                depth += block_depth_change(line);
+            }
         }
         
         // Process the command
         try {
-            process_command(input);
+            if (block.empty()) process_command(input);
+            else process_block(block);
         } catch (const std::exception& e) {
             show_error("Exception while processing command: " + std::string(e.what()));
         } catch (...) {
             show_error("Unknown exception while processing command");
         }
+        sync_open_files();
+        
+        // Exit condition
+        if (exit_requested) break;
     }
-    
-    // Cleanup
-    curl_global_cleanup();
 }
 
 int main(int argc, char* argv[]) {
+#ifdef _WIN32
     // Set console to support colors
     SetConsoleOutputCP(CP_UTF8);
     HANDLE hOut = GetStdHandle(STD_OUTPUT_HANDLE);
     DWORD dwMode = 0;
     GetConsoleMode(hOut, &dwMode);
     SetConsoleMode(hOut, dwMode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+#endif
     
     // Initialize random seed
     std::srand(static_cast<unsigned int>(std::time(nullptr)));
     
-    // Create log file if it doesn't exist
-    std::ofstream logFile("myshell.log", std::ios::app);
-    std::time_t now = std::time(nullptr);  // Get current time
-logFile << "[" << std::put_time(std::localtime(&now), "%Y-%m-%d %H:%M:%S") << "] MyShell started\n";
-
-    logFile.close();
+    log_message("MyShell started");
     
     // Register built-in functions
     functions["time"] = [](const std::vector<std::string>& args) -> std::string {
         auto now = std::chrono::system_clock::now();
         auto time = std::chrono::system_clock::to_time_t(now);
-        std::tm tm_buf;
-        localtime_s(&tm_buf, &time);
+        std::tm tm_buf = local_time(time);
         std::stringstream ss;
         ss << std::put_time(&tm_buf, "%H:%M:%S");
         return ss.str();
@@ -835,8 +7069,7 @@ logFile << "[" << std::put_time(std::localtime(&now), "%Y-%m-%d %H:%M:%S") << "]
     functions["date"] = [](const std::vector<std::string>& args) -> std::string {
         auto now = std::chrono::system_clock::now();
         auto time = std::chrono::system_clock::to_time_t(now);
-        std::tm tm_buf;
-        localtime_s(&tm_buf, &time);
+        std::tm tm_buf = local_time(time);
         std::stringstream ss;
         ss << std::put_time(&tm_buf, "%Y-%m-%d");
         return ss.str();
@@ -861,11 +7094,13 @@ logFile << "[" << std::put_time(std::localtime(&now), "%Y-%m-%d %H:%M:%S") << "]
         std::string scriptFile = argv[1];
         std::cout << "Running script file: " << scriptFile << std::endl;
         run_script(scriptFile);
+        close_open_files();
         return 0;
     }
     
     // Run interactive shell
     run_shell();
+    close_open_files();
     
     return 0;
 }
\ No newline at end of file